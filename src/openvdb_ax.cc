@@ -22,30 +22,106 @@
 
 #include <openvdb/openvdb.h>
 #include <openvdb/version.h>
+#include <openvdb/io/GridDescriptor.h>
 #include <openvdb/util/logging.h>
 #include <openvdb/util/CpuTimer.h>
+#include <openvdb/points/PointCount.h>
 #include <openvdb/points/PointDelete.h>
-
+#include <openvdb/points/PointGroup.h>
+#include <openvdb/tree/LeafManager.h>
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Host.h>
+
+// global_control is a preview feature in TBB 2018, see openvdb_render.cc
+#define TBB_PREVIEW_GLOBAL_CONTROL 1
+#include <tbb/global_control.h>
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+#include <tbb/task_group.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
 #include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
 const char* gProgName = "";
 
 void usage [[noreturn]] (int exitStatus = EXIT_FAILURE)
 {
     std::cerr <<
-    "Usage: " << gProgName << " [input.vdb [output.vdb] | analyze] [-s \"string\" | -f file.txt] [OPTIONS]\n" <<
+    "Usage: " << gProgName << " [input.vdb [output.vdb] | analyze] [-s \"string\" | -f file.txt]... [OPTIONS]\n" <<
     "Which: executes a string or file containing a code snippet on an input.vdb file\n\n" <<
     "Options:\n" <<
     "    -s snippet       execute code snippet on the input.vdb file\n" <<
     "    -f file.txt      execute text file containing a code snippet on the input.vdb file\n" <<
+    "                     -s and -f may be repeated to run several snippets in order. Consecutive\n" <<
+    "                     snippets are fused into a single pass over the data where that is\n" <<
+    "                     equivalent to running them one after the other, i.e. unless they write\n" <<
+    "                     to different volumes, one deletes points and a later one queries groups,\n" <<
+    "                     or one may return early, which would skip the snippets after it\n" <<
     "    -v               verbose (print timing and diagnostics)\n" <<
     "    --opt level      set an optimization level on the generated IR [NONE, O0, O1, O2, Os, Oz, O3]\n" <<
+    "    --vector-width n force the width of the loops that LLVM vectorizes in the generated kernels, or\n" <<
+    "                     disable loop vectorization with 1. By default, LLVM chooses the width for the\n" <<
+    "                     features of the host CPU, which the kernels are always compiled for\n" <<
+    "    --vectorize-report\n" <<
+    "                     print LLVM's remarks on which loops of the kernels were or were not vectorized,\n" <<
+    "                     and why, to stderr as they are compiled. Also useful with analyze --try-compile\n" <<
+    "    --llvm-args \"...\" pass the given options through to LLVM, e.g. \"-unroll-threshold=300\"\n" <<
+    "    --threads n      execute with at most n threads, or 0 to use all available CPUs (default: 0)\n" <<
+    "    --scaling [n]    instead of executing once, time the execution on 1, 2, 4... and n threads (by\n" <<
+    "                     default, all that are available), each on a fresh copy of the input, and report\n" <<
+    "                     the speedup and parallel efficiency over a single thread\n" <<
     "    --werror         set warnings as errors\n" <<
     "    --max-errors n   sets the maximum number of error messages to n, a value of 0 (default) allows all error messages\n" <<
+    "    --stream         read, execute, write and free one grid at a time, so that peak memory is bounded by the\n" <<
+    "                     largest grid. The grids are appended to output.vdb one by one, in the same order\n" <<
+    "                     as without --stream. Volumes are executed one at a time, so this requires that the\n" <<
+    "                     code accesses at most one of the volumes in input.vdb, and that input.vdb has no\n" <<
+    "                     two grids of the same name; otherwise all grids are processed together as usual\n" <<
+    "    --frames a-b     execute on each frame from a to b, compiling the code only once. The input.vdb path,\n" <<
+    "                     and output.vdb if given, must contain $F, which is replaced by the frame number, or\n" <<
+    "                     $F2 to $F9, which are replaced by the frame number padded with zeros to that many\n" <<
+    "                     digits, e.g. \"cache.$F4.vdb\". Frames that\n" <<
+    "                     fail are reported once all frames have been processed. The code is compiled for\n" <<
+    "                     the types of grid in the first frame\n" <<
+    "    --watch          keep the input resident and the compiler initialized, and execute again each time\n" <<
+    "                     a snippet given with -f changes, on a fresh copy of the input. Only the grids that\n" <<
+    "                     the code may modify are copied. Runs until interrupted, even if the code does\n" <<
+    "                     not parse or compile to begin with\n" <<
+    "    --report json    print a report of the time spent in each phase, per compilation and per grid\n" <<
+    "                     executed (with its voxel or point count and throughput), the peak resident\n" <<
+    "                     memory and the number of threads to stdout as JSON once the run has finished.\n" <<
+    "                     All other output, including that of -v and of analyze, then goes to stderr.\n" <<
+    "                     The execute phase includes the deletepoint phase, the compaction of points\n" <<
+    "                     removed with deletepoint(), as point grids are compacted while others execute\n" <<
+    "    --bbox x0 y0 z0 x1 y1 z1\n" <<
+    "                     only execute on the volumes that the code writes within the given world-space box\n" <<
+    "    --mask name      only execute on the volumes that the code writes where the named volume of the\n" <<
+    "                     input is active. The region is applied per leaf node and tile: nodes entirely\n" <<
+    "                     outside it are skipped, and nodes that overlap it are executed in full. Only\n" <<
+    "                     iteration is restricted; values outside the region can still be read\n" <<
+    "    --frame-jobs n   process at most n frames at once (default 2). Each frame is itself executed in\n" <<
+    "                     parallel, so this trades the memory held by the frames in flight against throughput\n" <<
     "    analyze          parse the provided code and enter analysis mode\n" <<
     "      --ast-print       descriptive print the abstract syntax tree generated\n" <<
     "      --re-print        re-interpret print of the provided code after ast traversal\n" <<
@@ -57,6 +133,9 @@ void usage [[noreturn]] (int exitStatus = EXIT_FAILURE)
     "      --list [name]     list all available functions, their documentation and their signatures.\n" <<
     "                        optionally only list functions which whose name includes a provided string.\n" <<
     "      --list-names      list all available functions names only\n" <<
+    "Output:\n" <<
+    "     Grids that the code does not write to are copied to output.vdb as they are encoded in\n" <<
+    "     input.vdb rather than encoded again, if input.vdb is of the current file format.\n" <<
     "Warning:\n" <<
     "     Providing the same file-path to both input.vdb and output.vdb arguments will overwrite\n" <<
     "     the file. If no output file is provided, the input.vdb will be processed but will remain\n" <<
@@ -76,12 +155,27 @@ struct ProgOptions
     bool mWarningsAsErrors = false;
 
     // Execute options
-    std::unique_ptr<std::string> mInputCode = nullptr;
+    std::vector<std::string> mInputCode;
+    std::vector<std::string> mInputFiles; // of each snippet, empty if given with -s
     std::string mInputVDBFile = "";
     std::string mOutputVDBFile = "";
     bool mVerbose = false;
+    bool mStream = false;
+    bool mWatch = false;
+    int mThreads = 0;
+    bool mScaling = false;
+    int mScalingThreads = 0;
+    bool mFrames = false;
+    int mFrameStart = 0;
+    int mFrameEnd = 0;
+    size_t mFrameJobs = 2;
+    bool mReport = false;
+    bool mRegionBBox = false;
+    openvdb::BBoxd mBBox;
+    std::string mMask = "";
     openvdb::ax::CompilerOptions::OptLevel mOptLevel =
         openvdb::ax::CompilerOptions::OptLevel::O3;
+    std::vector<std::string> mLLVMArgs;
 
     // Analyze options
     bool mPrintAST = false;
@@ -134,6 +228,7 @@ optLevelToString(const openvdb::ax::CompilerOptions::OptLevel level)
 {
     switch (level) {
         case  openvdb::ax::CompilerOptions::OptLevel::NONE : return "NONE";
+        case  openvdb::ax::CompilerOptions::OptLevel::O0 : return "O0";
         case  openvdb::ax::CompilerOptions::OptLevel::O1 : return "O1";
         case  openvdb::ax::CompilerOptions::OptLevel::O2 : return "O2";
         case  openvdb::ax::CompilerOptions::OptLevel::Os : return "Os";
@@ -178,6 +273,804 @@ struct OptParse
     }
 };
 
+inline std::string
+timeString(const double msec)
+{
+    std::ostringstream os;
+    openvdb::util::printTime(os, msec, "", "", 1, 1, 0);
+    return os.str();
+}
+
+/// @brief  Return a tree that executes the given snippets in order. Each
+///   snippet is scoped by a block of its own, so that local variables of the
+///   same name in different snippets do not collide.
+inline openvdb::ax::ast::Tree::ConstPtr
+fuseSnippets(const std::vector<openvdb::ax::ast::Tree::ConstPtr>& trees)
+{
+    if (trees.size() == 1) return trees.front();
+    openvdb::ax::ast::Block* block = new openvdb::ax::ast::Block();
+    for (const auto& tree : trees) {
+        block->addStatement(tree->child(0)->copy());
+    }
+    return openvdb::ax::ast::Tree::ConstPtr(new openvdb::ax::ast::Tree(block));
+}
+
+/// @brief  Return whether the given code contains a return statement, which
+///   ends the execution of the whole kernel for the current point or voxel.
+inline bool
+returnsEarly(const openvdb::ax::ast::Tree& tree)
+{
+    bool found = false;
+    openvdb::ax::ast::visitNodeType<openvdb::ax::ast::Keyword>(tree,
+        [&found](const openvdb::ax::ast::Keyword& keyword) -> bool {
+            found = keyword.keyword() == openvdb::ax::ast::tokens::RETURN;
+            return !found;
+        });
+    return found;
+}
+
+/// @brief  Partition the given snippets into passes of consecutive snippets
+///   that can be fused, and return the indices of the snippets of each pass.
+/// @details  Fusing snippets runs each in turn on one element before moving on
+///   to the next element, which is equivalent to running them in separate
+///   passes as long as each element only depends on its own values. Three cases
+///   break this. A volume kernel visits the active voxels of each volume that it
+///   writes, so snippets that write to different volumes must not be fused.
+///   Points deleted by a snippet are only removed after its pass, so they
+///   remain visible to group queries of later snippets in the same pass. And a
+///   return statement ends the fused kernel, not just its snippet, so a snippet
+///   that may return early ends its pass.
+/// @param volumes  whether the snippets are also executed on volumes
+inline std::vector<std::vector<size_t>>
+planPasses(const std::vector<openvdb::ax::ast::Tree::ConstPtr>& trees, const bool volumes)
+{
+    std::vector<std::vector<size_t>> passes;
+    std::set<std::string> written;
+    bool deletes = false, returns = false;
+    for (size_t i = 0; i < trees.size(); ++i) {
+        const openvdb::ax::ast::Tree& tree = *trees[i];
+        const openvdb::ax::AttributeRegistry::ConstPtr reg =
+            openvdb::ax::AttributeRegistry::create(tree);
+        std::set<std::string> writes;
+        for (const auto& access : reg->data()) {
+            if (access.writes()) writes.insert(access.name());
+        }
+
+        bool fuse = !passes.empty() && !returns;
+        if (fuse && volumes) {
+            std::set<std::string> all = written;
+            all.insert(writes.begin(), writes.end());
+            fuse = all.size() <= 1;
+        }
+        if (fuse && deletes) {
+            fuse = !openvdb::ax::ast::callsFunction(tree, "ingroup") &&
+                !openvdb::ax::ast::callsFunction(tree, "removefromgroup");
+        }
+        if (!fuse) {
+            passes.emplace_back();
+            written.clear();
+            deletes = false;
+        }
+        passes.back().emplace_back(i);
+        written.insert(writes.begin(), writes.end());
+        deletes |= openvdb::ax::ast::callsFunction(tree, "deletepoint");
+        returns = returnsEarly(tree);
+    }
+    return passes;
+}
+
+/// @brief  Return the number of elements processed per second, given the
+///   number processed in the given number of milliseconds.
+inline std::string
+rateString(const openvdb::Index64 count, const double msec)
+{
+    std::ostringstream os;
+    os << std::fixed << std::setprecision(0)
+       << (msec > 0.0 ? 1000.0 * double(count) / msec : 0.0);
+    return os.str();
+}
+
+/// @brief  Return the given path with $F replaced by the frame number and $F2
+///   to $F9 by the frame number padded with zeros to that many digits.
+inline std::string
+expandFrame(const std::string& pattern, const int frame)
+{
+    std::string path;
+    size_t pos = 0;
+    for (size_t found; (found = pattern.find("$F", pos)) != std::string::npos;) {
+        path.append(pattern, pos, found - pos);
+        pos = found + 2;
+        int width = 0;
+        if (pos < pattern.size() && pattern[pos] >= '2' && pattern[pos] <= '9') {
+            width = pattern[pos++] - '0';
+        }
+        std::ostringstream os;
+        os << std::setfill('0') << std::setw(width) << frame;
+        path += os.str();
+    }
+    path.append(pattern, pos, std::string::npos);
+    return path;
+}
+
+/// @brief  Return the names of the attributes and volumes the given code
+///   accesses or, if @a writesOnly, only those it writes to.
+inline std::set<std::string>
+accessedNames(const openvdb::ax::ast::Tree& tree, const bool writesOnly = false)
+{
+    const openvdb::ax::AttributeRegistry::ConstPtr reg =
+        openvdb::ax::AttributeRegistry::create(tree);
+    std::set<std::string> names;
+    for (const auto& access : reg->data()) {
+        if (!writesOnly || access.writes()) names.insert(access.name());
+    }
+    return names;
+}
+
+/// @brief  Remove the points of the given tree that deletepoint marked as
+///   "dead", along with the group that marked them.
+/// @details  The deletion is only paid for if some point was marked. The scan for
+///   a marked point stops at the first one it finds, so when points were deleted
+///   it costs little more than the deletion, and when none were it spares the
+///   deletion's traversal and the pruning after it.
+/// @param count  whether to count the points removed, at the cost of counting
+///   the points of the tree before and after the deletion
+/// @return the number of points removed if @a count, otherwise zero
+inline openvdb::Index64
+deleteDeadPoints(openvdb::points::PointDataTree& tree, const bool count)
+{
+    const auto leaf = tree.cbeginLeaf();
+    if (!leaf || !leaf->attributeSet().descriptor().hasGroup("dead")) return 0;
+
+    using LeafManagerT = openvdb::tree::LeafManager<const openvdb::points::PointDataTree>;
+    std::atomic<bool> anyDead(false);
+    LeafManagerT leafManager(tree);
+    tbb::parallel_for(leafManager.leafRange(),
+        [&](const LeafManagerT::LeafRange& range) {
+            for (auto iter = range.begin(); iter && !anyDead; ++iter) {
+                const openvdb::points::GroupHandle handle = iter->groupHandle("dead");
+                const openvdb::Index size = handle.isUniform() ? 1 : handle.size();
+                for (openvdb::Index n = 0; n < size; ++n) {
+                    if (handle.get(n)) {
+                        anyDead = true;
+                        break;
+                    }
+                }
+            }
+        });
+
+    if (!anyDead) {
+        openvdb::points::dropGroup(tree, "dead");
+        return 0;
+    }
+    const openvdb::Index64 before = count ? openvdb::points::pointCount(tree) : 0;
+    openvdb::points::deleteFromGroup(tree, "dead", /*invert=*/false, /*drop=*/true);
+    return count ? before - openvdb::points::pointCount(tree) : 0;
+}
+
+/// @brief  Return grids to execute on that leave the given grids as they are.
+/// @details  Only the grids that the code may modify, i.e. the volumes it writes
+///   to and all point grids, get trees of their own. The others share the trees
+///   of the given grids.
+inline openvdb::GridPtrVecPtr
+snapshotGrids(const openvdb::GridPtrVec& grids, const std::set<std::string>& written)
+{
+    openvdb::GridPtrVecPtr snapshot(new openvdb::GridPtrVec);
+    for (const openvdb::GridBase::Ptr& grid : grids) {
+        const bool modified = grid->isType<openvdb::points::PointDataGrid>() ||
+            written.count(grid->getName());
+        snapshot->emplace_back(modified ? grid->deepCopyGrid() : grid->copyGrid());
+    }
+    return snapshot;
+}
+
+/// @brief  The location of each grid in a .vdb file, with which grids can be
+///   copied from one file to another without being decoded and encoded again.
+struct FileLayout
+{
+    struct Grid
+    {
+        std::string mUniqueName, mName, mType;
+        int64_t mStart;   // of the grid descriptor
+        int64_t mPosPos;  // of the descriptor's (absolute) stream positions
+        int64_t mGridPos, mBlockPos, mEndPos;
+        bool mInstance;
+    };
+
+    /// @brief  Return the grid of the given unique name, or null if there is none.
+    /// @details  Unique names are compared as File::NameIterator::gridName()
+    ///   returns them, i.e. as formatted by GridDescriptor::nameAsString().
+    const Grid* find(const std::string& uniqueName) const
+    {
+        for (const Grid& grid : mGrids) {
+            if (grid.mUniqueName == uniqueName) return &grid;
+        }
+        return nullptr;
+    }
+
+    /// @brief  Read the layout of the file from the given stream.
+    /// @return false if the file is not of the current format, or has no grid
+    ///   offsets, as then its grids can not be copied into a file written now
+    bool read(std::istream& is)
+    {
+        int64_t magic = 0;
+        is.read(reinterpret_cast<char*>(&magic), sizeof(int64_t));
+        if (!is || magic != openvdb::OPENVDB_MAGIC) return false;
+        uint32_t version[3] = { 0, 0, 0 }; // file, library major and minor
+        is.read(reinterpret_cast<char*>(version), sizeof(version));
+        if (!is || version[0] != openvdb::OPENVDB_FILE_VERSION) return false;
+        char hasGridOffsets = 0;
+        is.read(&hasGridOffsets, sizeof(char));
+        if (!is || !hasGridOffsets) return false;
+        char uuid[36];
+        is.read(uuid, sizeof(uuid));
+        openvdb::io::setVersion(is, openvdb::VersionId(version[1], version[2]), version[0]);
+        openvdb::MetaMap().readMeta(is);
+
+        mCountPos = int64_t(is.tellg());
+        int32_t count = 0;
+        is.read(reinterpret_cast<char*>(&count), sizeof(int32_t));
+        for (int32_t i = 0; is && i < count; ++i) {
+            Grid grid;
+            grid.mStart = int64_t(is.tellg());
+            openvdb::io::GridDescriptor gd;
+            gd.read(is);
+            // In the form of File::NameIterator::gridName(), e.g. "density[1]",
+            // rather than the raw form with a record separator.
+            grid.mUniqueName = openvdb::io::GridDescriptor::nameAsString(gd.uniqueName());
+            grid.mName = gd.gridName();
+            grid.mType = gd.gridType();
+            grid.mGridPos = gd.getGridPos();
+            grid.mBlockPos = gd.getBlockPos();
+            grid.mEndPos = gd.getEndPos();
+            // the stream positions are written immediately before the grid
+            grid.mPosPos = grid.mGridPos - int64_t(3 * sizeof(int64_t));
+            grid.mInstance = gd.isInstance();
+            mGrids.emplace_back(grid);
+            gd.seekToEnd(is);
+        }
+        return bool(is);
+    }
+
+    int64_t mCountPos = 0; // of the grid count, which follows the header and metadata
+    std::vector<Grid> mGrids;
+};
+
+/// @brief  Return the path of a temporary file next to the given one, unique to
+///   this process and call, so that concurrent runs writing the same file do not
+///   overwrite each other's temporary files.
+inline std::string
+tempFileName(const std::string& path)
+{
+    static std::atomic<uint64_t> sCount(0);
+    static const uint64_t sSeed = (uint64_t(std::random_device()()) << 32) ^
+        uint64_t(std::chrono::steady_clock::now().time_since_epoch().count());
+    std::ostringstream os;
+    os << path << '.' << std::hex << sSeed << '.' << sCount++ << ".tmp";
+    return os.str();
+}
+
+inline void
+copyBytes(std::istream& is, const int64_t begin, const int64_t end, std::ostream& os)
+{
+    std::vector<char> buffer(size_t(1) << 20);
+    is.seekg(begin);
+    for (int64_t pos = begin; pos < end && is && os;) {
+        const std::streamsize size = std::streamsize(std::min(int64_t(buffer.size()), end - pos));
+        is.read(buffer.data(), size);
+        os.write(buffer.data(), is.gcount());
+        pos += is.gcount();
+    }
+}
+
+/// @brief  Copy a grid from a file of the given layout to the output stream,
+///   offsetting the descriptor's stream positions to where it is written.
+inline void
+copyGrid(std::istream& is, const FileLayout::Grid& grid, std::ostream& os)
+{
+    const int64_t offset = int64_t(os.tellp()) - grid.mStart;
+    copyBytes(is, grid.mStart, grid.mPosPos, os);
+    const int64_t pos[3] = {
+        grid.mGridPos + offset, grid.mBlockPos + offset, grid.mEndPos + offset };
+    os.write(reinterpret_cast<const char*>(pos), sizeof(pos));
+    copyBytes(is, grid.mGridPos, grid.mEndPos, os);
+}
+
+/// @brief  Write the given grids to a file, copying the encoded bytes of those
+///   that have not been modified since they were read from the input file
+///   rather than encoding them again.
+/// @details  The modified grids are written to a temporary file first, from
+///   which they are copied in turn, so that the grids keep their order.
+/// @param source  for each grid, the unique name (as iterated by io::File) of the
+///   grid in the input file that it is unmodified from, or empty if it is
+///   modified or new. The input grids are matched by name, not by position, as
+///   io::File iterates them in name order rather than in the order of the file.
+/// @return the number of grids copied from the input file, or -1 if the input
+///   file can not be copied from, in which case nothing has been written
+inline int
+writeCopyingUnmodified(const std::string& inputFile,
+    const std::string& outputFile,
+    const openvdb::GridPtrVec& grids,
+    const std::vector<std::string>& source,
+    const openvdb::MetaMap& meta)
+{
+    if (inputFile == outputFile) return -1;
+
+    std::ifstream input(inputFile, std::ios_base::in | std::ios_base::binary);
+    FileLayout inputLayout;
+    try {
+        if (!input || !inputLayout.read(input)) return -1;
+    }
+    catch (openvdb::Exception&) {
+        return -1;
+    }
+
+    openvdb::GridPtrVec modified;
+    std::vector<const FileLayout::Grid*> copies(grids.size(), nullptr);
+    int copied = 0;
+    for (size_t i = 0; i < grids.size(); ++i) {
+        if (source[i].empty()) {
+            modified.emplace_back(grids[i]);
+            continue;
+        }
+        // any doubt as to which grid this is falls back to writing all of them;
+        // instances refer to the data of another grid
+        const FileLayout::Grid* grid = inputLayout.find(source[i]);
+        if (!grid || grid->mInstance || grid->mName != grids[i]->getName() ||
+            grid->mType != grids[i]->type()) return -1;
+        copies[i] = grid;
+        ++copied;
+    }
+    if (copied == 0) return -1;
+
+    const std::string tempFile = tempFileName(outputFile);
+    openvdb::io::File(tempFile).write(modified, meta);
+
+    std::ifstream temp(tempFile, std::ios_base::in | std::ios_base::binary);
+    FileLayout tempLayout;
+    const bool valid = temp && tempLayout.read(temp) &&
+        tempLayout.mGrids.size() == modified.size();
+    if (!valid) {
+        temp.close();
+        std::remove(tempFile.c_str());
+        OPENVDB_THROW(openvdb::IoError, "unable to read back " << tempFile);
+    }
+
+    // the header and metadata are those that the library has just written
+    std::ofstream output(outputFile,
+        std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    copyBytes(temp, 0, tempLayout.mCountPos, output);
+    const int32_t count = int32_t(grids.size());
+    output.write(reinterpret_cast<const char*>(&count), sizeof(int32_t));
+    size_t next = 0;
+    for (size_t i = 0; i < grids.size(); ++i) {
+        if (copies[i]) copyGrid(input, *copies[i], output);
+        else copyGrid(temp, tempLayout.mGrids[next++], output);
+    }
+    output.close();
+    temp.close();
+    std::remove(tempFile.c_str());
+    if (!output || !input) {
+        OPENVDB_THROW(openvdb::IoError, "error writing " << outputFile);
+    }
+    return copied;
+}
+
+/// @brief  Apply the given functor to the given volume cast to its own type.
+/// @return false if the volume is not of one of the supported types
+template <typename OpT>
+inline bool
+processVolume(openvdb::GridBase& grid, OpT&& op)
+{
+    if (grid.isType<openvdb::BoolGrid>())        op(static_cast<openvdb::BoolGrid&>(grid));
+    else if (grid.isType<openvdb::FloatGrid>())  op(static_cast<openvdb::FloatGrid&>(grid));
+    else if (grid.isType<openvdb::DoubleGrid>()) op(static_cast<openvdb::DoubleGrid&>(grid));
+    else if (grid.isType<openvdb::Int32Grid>())  op(static_cast<openvdb::Int32Grid&>(grid));
+    else if (grid.isType<openvdb::Int64Grid>())  op(static_cast<openvdb::Int64Grid&>(grid));
+    else if (grid.isType<openvdb::Vec3IGrid>())  op(static_cast<openvdb::Vec3IGrid&>(grid));
+    else if (grid.isType<openvdb::Vec3SGrid>())  op(static_cast<openvdb::Vec3SGrid&>(grid));
+    else if (grid.isType<openvdb::Vec3DGrid>())  op(static_cast<openvdb::Vec3DGrid&>(grid));
+    else return false;
+    return true;
+}
+
+/// @brief  The region of space to which --bbox or --mask restrict execution.
+class Region
+{
+public:
+    explicit Region(const openvdb::BBoxd& bbox) : mBBox(bbox) {}
+
+    /// @throw TypeError if the mask is not of a supported volume type
+    explicit Region(openvdb::GridBase& mask)
+        : mMaskTransform(mask.transform().copy())
+    {
+        const bool supported = processVolume(mask, [this](auto& grid) {
+            mMask.reset(new openvdb::BoolTree(grid.tree(), false, true, openvdb::TopologyCopy()));
+        });
+        if (!supported) {
+            OPENVDB_THROW(openvdb::TypeError, "mask \"" << mask.getName()
+                << "\" is of unsupported type " << mask.type());
+        }
+        mBBox = worldBBox(mMask->evalActiveVoxelBoundingBox(), *mMaskTransform);
+    }
+
+    /// @brief  Return whether the given index-space box of a grid with the given
+    ///   transform may intersect the region.
+    /// @details  A mask is tested exactly against leaf nodes of a grid with the
+    ///   same transform, and by its world-space bounding box otherwise.
+    bool intersects(const openvdb::CoordBBox& bbox, const openvdb::math::Transform& xform) const
+    {
+        using MaskLeafT = openvdb::BoolTree::LeafNodeType;
+        if (mMask && bbox.dim() == openvdb::Coord(MaskLeafT::DIM) && xform == *mMaskTransform) {
+            if (const MaskLeafT* leaf = mMask->probeConstLeaf(bbox.min())) return !leaf->isEmpty();
+            return mMask->isValueOn(bbox.min());
+        }
+        return worldBBox(bbox, xform).hasOverlap(mBBox);
+    }
+
+private:
+    static openvdb::BBoxd
+    worldBBox(const openvdb::CoordBBox& bbox, const openvdb::math::Transform& xform)
+    {
+        if (bbox.empty()) return openvdb::BBoxd();
+        // voxels extend half a voxel either side of their centers
+        return xform.indexToWorld(openvdb::BBoxd(
+            bbox.min().asVec3d() - openvdb::Vec3d(0.5),
+            bbox.max().asVec3d() + openvdb::Vec3d(0.5)));
+    }
+
+    openvdb::BBoxd mBBox; // in world space
+    openvdb::BoolTree::Ptr mMask;
+    openvdb::math::Transform::Ptr mMaskTransform;
+};
+
+/// @brief  Return the region to which the options restrict execution on the
+///   given grids, or null if there is none.
+/// @throw LookupError if the mask is not one of the given grids
+inline std::unique_ptr<Region>
+makeRegion(const ProgOptions& opts, const openvdb::GridPtrVec& grids)
+{
+    if (opts.mRegionBBox) return std::unique_ptr<Region>(new Region(opts.mBBox));
+    if (opts.mMask.empty()) return nullptr;
+    for (const openvdb::GridBase::Ptr& grid : grids) {
+        if (grid->getName() == opts.mMask && !grid->isType<openvdb::points::PointDataGrid>()) {
+            return std::unique_ptr<Region>(new Region(*grid));
+        }
+    }
+    OPENVDB_THROW(openvdb::LookupError, "mask \"" << opts.mMask << "\" not found");
+}
+
+/// @brief  Deactivates, for its lifetime, the leaf nodes and active tiles of the
+///   given volumes that lie entirely outside a region, so that a volume
+///   executable skips them. Their values are left in place, and so can still be
+///   read, and their active states are restored on destruction.
+class RegionScope
+{
+public:
+    /// @param written  the names of the volumes the code writes to, which are
+    ///   the volumes whose active voxels it iterates
+    /// @param region  the region, or null to leave the volumes as they are
+    RegionScope(const openvdb::GridPtrVec& grids,
+        const std::set<std::string>& written,
+        const Region* region)
+    {
+        if (!region) return;
+        for (const openvdb::GridBase::Ptr& grid : grids) {
+            if (grid->isType<openvdb::points::PointDataGrid>()) continue;
+            if (!written.count(grid->getName())) continue;
+            const bool supported = processVolume(*grid, [&](auto& typed) {
+                this->deactivate(typed.tree(), typed.transform(), *region);
+            });
+            if (!supported) {
+                OPENVDB_LOG_WARN("volume \"" << grid->getName() << "\" of type "
+                    << grid->type() << " is executed outside of the region");
+            }
+        }
+    }
+
+    ~RegionScope() { for (const auto& restore : mRestore) restore(); }
+
+    openvdb::Index64 leafCount() const { return mLeaves; }
+    openvdb::Index64 tileCount() const { return mTiles; }
+
+private:
+    template <typename TreeT>
+    void deactivate(TreeT& tree, const openvdb::math::Transform& xform, const Region& region)
+    {
+        using LeafT = typename TreeT::LeafNodeType;
+        using NodeMaskT = typename LeafT::NodeMaskType;
+        using TileT = std::pair<openvdb::Coord, openvdb::Index>; // origin and level
+
+        auto leaves = std::make_shared<std::vector<std::pair<LeafT*, NodeMaskT>>>();
+        for (auto iter = tree.beginLeaf(); iter; ++iter) {
+            if (region.intersects(iter->getNodeBoundingBox(), xform)) continue;
+            leaves->emplace_back(iter.getLeaf(), iter->getValueMask());
+            iter->setValuesOff();
+        }
+
+        // collect the tiles before deactivating any, so as not to invalidate the iterator
+        auto tiles = std::make_shared<std::vector<TileT>>();
+        typename TreeT::ValueOnIter iter = tree.beginValueOn();
+        iter.setMaxDepth(TreeT::ValueOnIter::LEAF_DEPTH - 1);
+        for (; iter; ++iter) {
+            openvdb::CoordBBox bbox;
+            iter.getBoundingBox(bbox);
+            if (region.intersects(bbox, xform)) continue;
+            tiles->emplace_back(bbox.min(), iter.getLevel());
+        }
+        for (const TileT& tile : *tiles) {
+            tree.addTile(tile.second, tile.first, tree.getValue(tile.first), false);
+        }
+
+        mLeaves += leaves->size();
+        mTiles += tiles->size();
+        mRestore.emplace_back([&tree, leaves, tiles]() {
+            for (auto& leaf : *leaves) leaf.first->setValueMask(leaf.second);
+            for (const TileT& tile : *tiles) {
+                tree.addTile(tile.second, tile.first, tree.getValue(tile.first), true);
+            }
+        });
+    }
+
+    std::vector<std::function<void()>> mRestore;
+    openvdb::Index64 mLeaves = 0, mTiles = 0;
+};
+
+/// @brief  Read the grids of an open file that are needed to execute code that
+///   accesses the given names: all point grids, the volumes that are accessed
+///   and, if @a passThrough, all other volumes so that they can be written out.
+/// @note  Only volumes are selected by name. Point grids are read whole, as the
+///   attributes they load are decided by delayed loading, not by this function.
+/// @param metadata  the metadata of the file's grids, in the (descriptor) order
+///   in which their names are iterated
+/// @param skipped  if non-null, incremented for each volume that is not read
+/// @param uniqueNames  if non-null, set to the unique name of each grid read, as
+///   formatted by GridDescriptor::nameAsString()
+inline openvdb::GridPtrVecPtr
+readGrids(openvdb::io::File& file,
+    const openvdb::GridPtrVec& metadata,
+    const std::set<std::string>& names,
+    const bool passThrough,
+    size_t* skipped = nullptr,
+    std::vector<std::string>* uniqueNames = nullptr)
+{
+    openvdb::GridPtrVecPtr grids(new openvdb::GridPtrVec);
+    if (uniqueNames) uniqueNames->clear();
+    auto metaIter = metadata.cbegin();
+    for (auto iter = file.beginName(); iter != file.endName(); ++iter, ++metaIter) {
+        const openvdb::GridBase& grid = **metaIter;
+        if (grid.isType<openvdb::points::PointDataGrid>() ||
+            passThrough || names.count(grid.getName())) {
+            grids->emplace_back(file.readGrid(iter.gridName()));
+            if (uniqueNames) uniqueNames->emplace_back(iter.gridName());
+        }
+        else if (skipped) {
+            ++(*skipped);
+        }
+    }
+    return grids;
+}
+
+/// @brief  Compiles the input code for one executable type with a compiler
+///   (and so an LLVM context), custom data and logger of its own, so that the
+///   compilations for points and for volumes can run concurrently.
+/// @note  Diagnostics are buffered until flush() so that those of concurrent
+///   compilations are not interleaved. Each job parses the code again, serially
+///   on construction, as a logger can only locate the nodes it has parsed.
+template <typename ExeT>
+struct CompileJob
+{
+    CompileJob(const std::vector<std::string>& snippets, const ProgOptions& opts)
+        : mLogs([this](const std::string& msg) { mMessages.emplace_back(msg); },
+                [this](const std::string& msg) { mMessages.emplace_back(msg); })
+        , mOptLevel(opts.mOptLevel)
+    {
+        mLogs.setMaxErrors(opts.mMaxErrors);
+        mLogs.setWarningsAsErrors(opts.mWarningsAsErrors);
+        // nodes are located by line and column within their own snippet, but
+        // the logger only holds the text of the last snippet it parsed
+        mLogs.setPrintLines(snippets.size() == 1);
+        mLogs.setNumberedOutput(true);
+        std::vector<openvdb::ax::ast::Tree::ConstPtr> trees;
+        for (const std::string& code : snippets) {
+            trees.emplace_back(openvdb::ax::ast::parse(code.c_str(), mLogs));
+            if (!trees.back()) break;
+        }
+        if (trees.back()) mTree = fuseSnippets(trees);
+        // parse diagnostics have already been reported
+        mMessages.clear();
+    }
+
+    void run()
+    {
+        openvdb::util::CpuTimer timer;
+        if (mTree) {
+            try {
+                openvdb::ax::CompilerOptions compOpts;
+                compOpts.mOptLevel = mOptLevel;
+                openvdb::ax::Compiler::Ptr compiler =
+                    openvdb::ax::Compiler::create(compOpts);
+                mExe = compiler->compile<ExeT>(*mTree, mLogs,
+                    openvdb::ax::CustomData::create());
+            }
+            catch (std::exception& e) {
+                mException = e.what();
+                mExe.reset();
+            }
+        }
+        mMilliseconds = timer.milliseconds();
+    }
+
+    void flush() const
+    {
+        for (const std::string& msg : mMessages) std::cerr << msg << std::endl;
+    }
+
+    bool failed() const { return !mExe || mLogs.hasError() || !mException.empty(); }
+    bool hasWarning() const { return mLogs.hasWarning(); }
+
+    openvdb::ax::Logger mLogs;
+    std::vector<std::string> mMessages;
+    const openvdb::ax::CompilerOptions::OptLevel mOptLevel;
+    openvdb::ax::ast::Tree::ConstPtr mTree;
+    typename ExeT::Ptr mExe;
+    std::string mException;
+    double mMilliseconds = 0.0;
+};
+
+inline std::string
+jsonString(const std::string& str)
+{
+    std::ostringstream ostr;
+    ostr << '"';
+    for (const char c: str) {
+        switch (c) {
+            case '"': ostr << "\\\""; break;
+            case '\\': ostr << "\\\\"; break;
+            case '\n': ostr << "\\n"; break;
+            case '\t': ostr << "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    ostr << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+                        << int(c) << std::dec << std::setfill(' ');
+                } else {
+                    ostr << c;
+                }
+        }
+    }
+    ostr << '"';
+    return ostr.str();
+}
+
+/// @brief Return the peak resident set size of this process in bytes,
+/// or zero if it is unavailable on this platform.
+inline uint64_t
+peakRssBytes()
+{
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#if defined(__APPLE__)
+    return static_cast<uint64_t>(usage.ru_maxrss); // in bytes
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024; // in kilobytes
+#endif
+#endif
+}
+
+/// @brief  Timings and counts gathered over a run for --report json, so that
+///   they can be aggregated across many runs.
+/// @note  Volumes are executed together, so their timing is per pass, with the
+///   active voxel count of each volume; points are timed per grid.
+struct Report
+{
+    struct Compilation
+    {
+        std::string mKind;
+        size_t mPass;
+        double mMilliseconds;
+        bool mSuccess;
+    };
+
+    struct Execution
+    {
+        std::string mKind;
+        size_t mPass;
+        double mMilliseconds;
+        // grid names and their point or active voxel counts
+        std::vector<std::pair<std::string, openvdb::Index64>> mGrids;
+    };
+
+    struct Deletion
+    {
+        std::string mGrid;
+        size_t mPass;
+        openvdb::Index64 mDeleted;
+        double mMilliseconds;
+    };
+
+    struct Frame
+    {
+        int mFrame;
+        double mRead, mExecute, mWrite;
+        std::string mError;
+    };
+
+    /// Add to the time spent in the named phase.
+    void addPhase(const std::string& name, const double msec)
+    {
+        for (auto& phase : mPhases) {
+            if (phase.first == name) { phase.second += msec; return; }
+        }
+        mPhases.emplace_back(name, msec);
+    }
+
+    void print(std::ostream& os) const
+    {
+        auto rate = [](const openvdb::Index64 count, const double msec) {
+            return msec > 0.0 ? 1000.0 * double(count) / msec : 0.0;
+        };
+
+        os << std::fixed << std::setprecision(3) << "{\n"
+           << "    \"library\": " << jsonString(openvdb::getLibraryVersionString()) << ",\n"
+           << "    \"threads\": " << std::min(size_t(tbb::this_task_arena::max_concurrency()),
+               tbb::global_control::active_value(
+                   tbb::global_control::max_allowed_parallelism)) << ",\n"
+           << "    \"peakRssBytes\": " << peakRssBytes() << ",\n"
+           << "    \"phases\": {";
+        for (size_t i = 0; i < mPhases.size(); ++i) {
+            os << (i ? "," : "") << "\n        " << jsonString(mPhases[i].first)
+               << ": " << mPhases[i].second;
+        }
+        os << "\n    },\n    \"compilations\": [";
+        for (size_t i = 0; i < mCompilations.size(); ++i) {
+            const Compilation& c = mCompilations[i];
+            os << (i ? "," : "") << "\n        { \"kind\": " << jsonString(c.mKind)
+               << ", \"pass\": " << c.mPass << ", \"milliseconds\": " << c.mMilliseconds
+               << ", \"success\": " << (c.mSuccess ? "true" : "false") << " }";
+        }
+        os << "\n    ],\n    \"executions\": [";
+        for (size_t i = 0; i < mExecutions.size(); ++i) {
+            const Execution& e = mExecutions[i];
+            openvdb::Index64 total = 0;
+            os << (i ? "," : "") << "\n        { \"kind\": " << jsonString(e.mKind)
+               << ", \"pass\": " << e.mPass << ", \"milliseconds\": " << e.mMilliseconds
+               << ", \"grids\": [";
+            for (size_t g = 0; g < e.mGrids.size(); ++g) {
+                os << (g ? ", " : "") << "{ \"name\": " << jsonString(e.mGrids[g].first)
+                   << ", \"count\": " << e.mGrids[g].second << " }";
+                total += e.mGrids[g].second;
+            }
+            os << "], \"count\": " << total
+               << ", \"perSecond\": " << rate(total, e.mMilliseconds) << " }";
+        }
+        os << "\n    ],\n    \"deletions\": [";
+        for (size_t i = 0; i < mDeletions.size(); ++i) {
+            const Deletion& d = mDeletions[i];
+            os << (i ? "," : "") << "\n        { \"grid\": " << jsonString(d.mGrid)
+               << ", \"pass\": " << d.mPass << ", \"deleted\": " << d.mDeleted
+               << ", \"milliseconds\": " << d.mMilliseconds << " }";
+        }
+        os << "\n    ],\n    \"frames\": [";
+        for (size_t i = 0; i < mFrames.size(); ++i) {
+            const Frame& f = mFrames[i];
+            os << (i ? "," : "") << "\n        { \"frame\": " << f.mFrame
+               << ", \"read\": " << f.mRead << ", \"execute\": " << f.mExecute
+               << ", \"write\": " << f.mWrite;
+            if (!f.mError.empty()) os << ", \"error\": " << jsonString(f.mError);
+            os << " }";
+        }
+        os << "\n    ]\n}" << std::endl;
+    }
+
+    std::vector<std::pair<std::string, double>> mPhases; // in milliseconds
+    std::vector<Compilation> mCompilations;
+    std::vector<Execution> mExecutions;
+    std::vector<Deletion> mDeletions;
+    std::vector<Frame> mFrames;
+};
+
 struct ScopedInitialize
 {
     ScopedInitialize(int argc, char *argv[]) {
@@ -294,35 +1187,90 @@ main(int argc, char *argv[])
 
     openvdb::util::CpuTimer timer;
     auto getTime = [&timer]() -> std::string {
-        const double msec = timer.milliseconds();
-        std::ostringstream os;
-        openvdb::util::printTime(os, msec, "", "", 1, 1, 0);
-        return os.str();
+        return timeString(timer.milliseconds());
     };
 
-    auto& os = std::cout;
+    // limits the number of threads for --threads; declared before the report
+    // printer so that it is still in effect when the report is printed
+    std::unique_ptr<tbb::global_control> control;
+
+    // printed when main returns, whether or not the run succeeded
+    struct ReportPrinter
+    {
+        ~ReportPrinter() { if (mReport) mReport->print(std::cout); }
+        std::unique_ptr<Report> mReport;
+    } reportPrinter;
+    Report* report = nullptr;
+
 #define axlog(message) \
     { if (opts.mVerbose) os << message; }
 #define axtimer() timer.restart()
 #define axtime() getTime()
+#define axreport(phase) \
+    { if (report) report->addPhase(phase, timer.milliseconds()); }
 
-    bool multiSnippet = false;
     for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
         if (arg[0] == '-') {
             if (parser.check(i, "-s")) {
                 ++i;
-                multiSnippet |= static_cast<bool>(opts.mInputCode);
-                opts.mInputCode.reset(new std::string(argv[i]));
+                opts.mInputCode.emplace_back(argv[i]);
+                opts.mInputFiles.emplace_back();
             } else if (parser.check(i, "-f")) {
                 ++i;
-                multiSnippet |= static_cast<bool>(opts.mInputCode);
-                opts.mInputCode.reset(new std::string());
-                loadSnippetFile(argv[i], *opts.mInputCode);
+                opts.mInputCode.emplace_back();
+                opts.mInputFiles.emplace_back(argv[i]);
+                loadSnippetFile(argv[i], opts.mInputCode.back());
             } else if (parser.check(i, "-v", 0)) {
                 opts.mVerbose = true;
             } else if (parser.check(i, "--max-errors")) {
                 opts.mMaxErrors = atoi(argv[++i]);
+            } else if (parser.check(i, "--stream", 0)) {
+                opts.mStream = true;
+            } else if (parser.check(i, "--watch", 0)) {
+                opts.mWatch = true;
+            } else if (parser.check(i, "--threads")) {
+                opts.mThreads = std::max(0, atoi(argv[++i]));
+            } else if (parser.check(i, "--scaling", 0)) {
+                opts.mScaling = true;
+                if (i + 1 >= argc) continue;
+                if (argv[i+1][0] < '0' || argv[i+1][0] > '9') continue;
+                opts.mScalingThreads = std::max(0, atoi(argv[++i]));
+            } else if (parser.check(i, "--frames")) {
+                ++i;
+                const int count = sscanf(argv[i], "%d-%d", &opts.mFrameStart, &opts.mFrameEnd);
+                if (count == 1) opts.mFrameEnd = opts.mFrameStart;
+                if (count < 1 || opts.mFrameEnd < opts.mFrameStart) {
+                    OPENVDB_LOG_FATAL("invalid frame range given for --frames: " << argv[i]);
+                    usage();
+                }
+                opts.mFrames = true;
+            } else if (parser.check(i, "--report")) {
+                ++i;
+                if (std::string(argv[i]) != "json") {
+                    OPENVDB_LOG_FATAL("invalid format given for --report: " << argv[i]);
+                    usage();
+                }
+                opts.mReport = true;
+            } else if (parser.check(i, "--bbox", 6)) {
+                openvdb::Vec3d min, max;
+                for (int n = 0; n < 3; ++n) min[n] = atof(argv[++i]);
+                for (int n = 0; n < 3; ++n) max[n] = atof(argv[++i]);
+                opts.mBBox = openvdb::BBoxd(min, max);
+                opts.mRegionBBox = true;
+            } else if (parser.check(i, "--mask")) {
+                opts.mMask = argv[++i];
+            } else if (parser.check(i, "--frame-jobs")) {
+                opts.mFrameJobs = std::max(1, atoi(argv[++i]));
+            } else if (parser.check(i, "--vector-width")) {
+                opts.mLLVMArgs.emplace_back(std::string("-force-vector-width=") + argv[++i]);
+            } else if (parser.check(i, "--vectorize-report", 0)) {
+                opts.mLLVMArgs.emplace_back("-pass-remarks=loop-vectorize|slp-vectorizer");
+                opts.mLLVMArgs.emplace_back("-pass-remarks-missed=loop-vectorize|slp-vectorizer");
+                opts.mLLVMArgs.emplace_back("-pass-remarks-analysis=loop-vectorize");
+            } else if (parser.check(i, "--llvm-args")) {
+                std::istringstream args(argv[++i]);
+                for (std::string arg; args >> arg;) opts.mLLVMArgs.emplace_back(arg);
             } else if (parser.check(i, "--werror", 0)) {
                 opts.mWarningsAsErrors = true;
             } else if (parser.check(i, "--list", 0)) {
@@ -393,6 +1341,14 @@ main(int argc, char *argv[])
         }
     }
 
+    if (opts.mReport) {
+        reportPrinter.mReport.reset(new Report);
+        report = reportPrinter.mReport.get();
+    }
+
+    // The report is the only output on stdout, so that it can be parsed as is
+    std::ostream& os = opts.mReport ? std::cerr : std::cout;
+
     if (opts.mVerbose) {
         axlog("OpenVDB AX " << openvdb::getLibraryVersionString() << '\n');
         axlog("----------------\n");
@@ -414,37 +1370,36 @@ main(int argc, char *argv[])
         }
         if (opts.mMode == ProgOptions::Execute ||
             opts.mMode == ProgOptions::Analyze) {
-            axlog("  ax code : ");
-            if (opts.mInputCode && !opts.mInputCode->empty()) {
-                const bool containsnl =
-                    opts.mInputCode->find('\n') != std::string::npos;
-                if (containsnl) axlog("\n    ");
-
-                // indent output
-                const char* c = opts.mInputCode->c_str();
-                while (*c != '\0') {
-                    axlog(*c);
-                    if (*c == '\n') axlog("    ");
-                    ++c;
+            for (const std::string& code : opts.mInputCode) {
+                axlog("  ax code : ");
+                if (!code.empty()) {
+                    const bool containsnl =
+                        code.find('\n') != std::string::npos;
+                    if (containsnl) axlog("\n    ");
+
+                    // indent output
+                    const char* c = code.c_str();
+                    while (*c != '\0') {
+                        axlog(*c);
+                        if (*c == '\n') axlog("    ");
+                        ++c;
+                    }
                 }
+                else {
+                    axlog("\"\"");
+                }
+                axlog('\n');
             }
-            else {
-                axlog("\"\"");
-            }
-            axlog('\n');
             axlog('\n');
         }
         axlog(std::flush);
     }
 
     if (opts.mMode != ProgOptions::Functions) {
-        if (!opts.mInputCode) {
+        if (opts.mInputCode.empty()) {
             OPENVDB_LOG_FATAL("expected at least one AX file or a code snippet");
             usage();
         }
-        if (multiSnippet) {
-            OPENVDB_LOG_WARN("multiple code snippets provided, only using last input.");
-        }
     }
 
     if (opts.mMode == ProgOptions::Execute) {
@@ -452,14 +1407,62 @@ main(int argc, char *argv[])
             OPENVDB_LOG_FATAL("expected at least one VDB file or analysis mode");
             usage();
         }
+        if (opts.mFrames && opts.mInputVDBFile.find("$F") == std::string::npos) {
+            OPENVDB_LOG_FATAL("expected $F in the input VDB file name with --frames");
+            usage();
+        }
         if (opts.mOutputVDBFile.empty()) {
             OPENVDB_LOG_WARN("no output VDB File specified - nothing will be written to disk");
         }
+        else if (opts.mFrames && opts.mOutputVDBFile.find("$F") == std::string::npos) {
+            OPENVDB_LOG_FATAL("expected $F in the output VDB file name with --frames");
+            usage();
+        }
+        if (opts.mFrames && opts.mStream) {
+            OPENVDB_LOG_WARN("--stream ignored with --frames");
+            opts.mStream = false;
+        }
+        if (opts.mWatch) {
+            if (std::all_of(opts.mInputFiles.cbegin(), opts.mInputFiles.cend(),
+                    [](const std::string& file) { return file.empty(); })) {
+                OPENVDB_LOG_FATAL("expected at least one AX file to --watch");
+                usage();
+            }
+            if (opts.mStream || opts.mFrames) {
+                OPENVDB_LOG_WARN("--stream and --frames ignored with --watch");
+                opts.mStream = opts.mFrames = false;
+            }
+        }
+        if (opts.mScaling && (opts.mStream || opts.mFrames || opts.mWatch)) {
+            OPENVDB_LOG_WARN("--stream, --frames and --watch ignored with --scaling");
+            opts.mStream = opts.mFrames = opts.mWatch = false;
+        }
+        if (opts.mRegionBBox && !opts.mMask.empty()) {
+            OPENVDB_LOG_FATAL("expected at most one of --bbox and --mask");
+            usage();
+        }
+        if (!opts.mMask.empty() && opts.mStream) {
+            OPENVDB_LOG_WARN("--stream ignored with --mask");
+            opts.mStream = false;
+        }
+        if (opts.mStream && opts.mOutputVDBFile == opts.mInputVDBFile) {
+            // the output is written while the input is still being read
+            OPENVDB_LOG_WARN("--stream ignored as the output file is the input file");
+            opts.mStream = false;
+        }
+    }
+
+    // note, opts.mThreads == 0 means use all threads (default), so don't
+    // manually create a tbb::global_control in this case
+    if (opts.mThreads > 0) {
+        control.reset(new tbb::global_control(
+            tbb::global_control::max_allowed_parallelism, opts.mThreads));
     }
 
     axtimer();
     axlog("[INFO] Initializing OpenVDB" << std::flush);
     ScopedInitialize initializer(argc, argv);
+    axreport("initialize");
     axlog(": " << axtime() << '\n');
 
     // read vdb file data for
@@ -467,20 +1470,25 @@ main(int argc, char *argv[])
     openvdb::GridPtrVecPtr grids;
     openvdb::MetaMap::Ptr meta;
 
+    // Only the grids' metadata is read up front. Once the code has been parsed,
+    // the grids it needs are read (or, when streaming, each grid is read in turn
+    // once the code has been compiled)
+
     if (opts.mMode == ProgOptions::Execute) {
-        openvdb::io::File file(opts.mInputVDBFile);
+        // with --frames, the first frame determines what the code is compiled for
+        openvdb::io::File file(opts.mFrames ?
+            expandFrame(opts.mInputVDBFile, opts.mFrameStart) : opts.mInputVDBFile);
         try {
             axtimer();
-            axlog("[INFO] Reading VDB data"
-                << (openvdb::io::Archive::isDelayedLoadingEnabled() ?
-                    " (delay-load)" : "") << std::flush);
+            axlog("[INFO] Reading VDB metadata" << std::flush);
             file.open();
-            grids = file.getGrids();
+            grids = file.readAllGridMetadata();
             meta = file.getMetadata();
             file.close();
+            axreport("readMetadata");
             axlog(": " << axtime() << '\n');
         } catch (openvdb::Exception& e) {
-            OPENVDB_LOG_ERROR(e.what() << " (" << opts.mInputVDBFile << ")");
+            OPENVDB_LOG_ERROR(e.what() << " (" << file.filename() << ")");
             return EXIT_FAILURE;
         }
     }
@@ -489,7 +1497,29 @@ main(int argc, char *argv[])
         axtimer();
         axlog("[INFO] Initializing AX/LLVM" << std::flush);
         initializer.initializeCompiler();
+        if (!opts.mLLVMArgs.empty()) {
+            // LLVM's options are global, so are set once for all compilations
+            std::vector<const char*> args(1, gProgName);
+            for (const std::string& arg : opts.mLLVMArgs) args.emplace_back(arg.c_str());
+            if (!llvm::cl::ParseCommandLineOptions(int(args.size()), args.data(),
+                    "", &llvm::errs())) {
+                OPENVDB_LOG_FATAL("invalid LLVM options");
+                return EXIT_FAILURE;
+            }
+        }
+        axreport("initialize");
         axlog(": " << axtime() << '\n');
+        if (opts.mVerbose) {
+            // the kernels are compiled for the host CPU and its features
+            llvm::StringMap<bool> features;
+            llvm::sys::getHostCPUFeatures(features);
+            axlog("[INFO] | Host CPU [" << llvm::sys::getHostCPUName().str() << "]");
+            for (const char* feature : { "sse4.2", "avx", "avx2", "fma", "avx512f", "neon" }) {
+                if (features.lookup(feature)) axlog(' ' << feature);
+            }
+            for (const std::string& arg : opts.mLLVMArgs) axlog(' ' << arg);
+            axlog('\n');
+        }
     }
 
     if (opts.mMode == ProgOptions::Functions) {
@@ -498,7 +1528,7 @@ main(int argc, char *argv[])
             assert(opts.mFunctionNamesOnly || initializer.isInitialized());
             printFunctions(opts.mFunctionNamesOnly,
                 opts.mFunctionSearch,
-                std::cout);
+                os);
         }
         return EXIT_SUCCESS;
     }
@@ -518,29 +1548,119 @@ main(int argc, char *argv[])
     axtimer();
     axlog("[INFO] Parsing input code" << std::flush);
 
+    std::vector<openvdb::ax::ast::Tree::ConstPtr> syntaxTrees;
+    bool parsed = true;
+    for (const std::string& code : opts.mInputCode) {
+        syntaxTrees.emplace_back(openvdb::ax::ast::parse(code.c_str(), logs));
+        if (!syntaxTrees.back()) {
+            parsed = false;
+            break;
+        }
+    }
+    // when watching, the input is read and watched regardless, so that the code
+    // can be fixed without restarting
+    const bool watch = opts.mMode == ProgOptions::Execute && opts.mWatch;
+    if (!parsed && !watch) return EXIT_FAILURE;
+    // all snippets in order, for analysis and to find what they access
     const openvdb::ax::ast::Tree::ConstPtr syntaxTree =
-        openvdb::ax::ast::parse(opts.mInputCode->c_str(), logs);
-        axlog(": " << axtime() << '\n');
-    if (!syntaxTree) {
-        return EXIT_FAILURE;
+        parsed ? fuseSnippets(syntaxTrees) : nullptr;
+    axreport("parse");
+    axlog(": " << (parsed ? axtime() : std::string("failed")) << '\n');
+
+    axtimer();
+    std::set<std::string> names, written;
+    if (syntaxTree) {
+        names = accessedNames(*syntaxTree);
+        written = accessedNames(*syntaxTree, /*writesOnly=*/true);
+    }
+    axreport("registry");
+
+    // Streaming executes each volume on its own, which is only equivalent to
+    // executing them together if the code accesses no more than one of them.
+    // The accessed names also include point attributes, which do not count.
+
+    std::string streamVolume;
+    if (opts.mMode == ProgOptions::Execute && opts.mStream) {
+        std::set<std::string> volumes, gridNames;
+        bool duplicates = false, hasPoints = false;
+        for (auto grid : *grids) {
+            duplicates |= !gridNames.insert(grid->getName()).second;
+            if (grid->isType<openvdb::points::PointDataGrid>()) hasPoints = true;
+            else if (names.count(grid->getName())) volumes.insert(grid->getName());
+        }
+        // without points, a name written to that is not a volume is a new volume
+        const bool creates = !hasPoints && std::any_of(written.cbegin(), written.cend(),
+            [&volumes](const std::string& name) { return !volumes.count(name); });
+        if (volumes.size() > 1 || creates) {
+            OPENVDB_LOG_WARN("--stream ignored: the code accesses more than one volume, "
+                "or creates one");
+            opts.mStream = false;
+        }
+        else if (duplicates && !opts.mOutputVDBFile.empty()) {
+            // each grid is written on its own, so the names could not be made unique
+            OPENVDB_LOG_WARN("--stream ignored: the input has grids of the same name");
+            opts.mStream = false;
+        }
+        else if (!volumes.empty()) {
+            streamVolume = *volumes.begin();
+        }
+    }
+
+    // A mask is read along with the volumes the code accesses
+    if (!opts.mMask.empty()) names.insert(opts.mMask);
+
+    // Read the point grids and the volumes that the code accesses, and any other
+    // volumes only if they are to be written out. Skipping volumes is the only
+    // saving here: grids are delay-loaded as before, which already leaves point
+    // attributes and the buffers of passed-through volumes on disk until they are
+    // executed on, compacted or written
+
+    // the grids as they are in the input, when all of them are read, and
+    // their unique names in the input file
+    openvdb::GridPtrVec inputGrids;
+    std::vector<std::string> inputNames;
+
+    if (opts.mMode == ProgOptions::Execute && !opts.mStream && !opts.mFrames) {
+        openvdb::io::File file(opts.mInputVDBFile);
+        try {
+            axtimer();
+            axlog("[INFO] Reading VDB data"
+                << (openvdb::io::Archive::isDelayedLoadingEnabled() ?
+                    " (delay-load)" : "") << std::flush);
+            file.open();
+            size_t skipped = 0;
+            // when watching, the code may come to access any of the grids
+            grids = readGrids(file, *grids, names,
+                !opts.mOutputVDBFile.empty() || opts.mWatch, &skipped, &inputNames);
+            file.close();
+            if (skipped == 0) inputGrids = *grids;
+            axreport("read");
+            axlog(": " << axtime());
+            if (skipped > 0) axlog(" (skipped " << skipped << " unreferenced volume"
+                << (skipped == 1 ? "" : "s") << ")");
+            axlog('\n');
+        } catch (openvdb::Exception& e) {
+            OPENVDB_LOG_ERROR(e.what() << " (" << opts.mInputVDBFile << ")");
+            return EXIT_FAILURE;
+        }
     }
 
     if (opts.mMode == ProgOptions::Analyze) {
         axlog("[INFO] Running analysis options\n" << std::flush);
         if (opts.mPrintAST) {
             axlog("[INFO] | Printing AST\n" << std::flush);
-            openvdb::ax::ast::print(*syntaxTree, true, std::cout);
+            openvdb::ax::ast::print(*syntaxTree, true, os);
         }
         if (opts.mReprint) {
             axlog("[INFO] | Reprinting code\n" << std::flush);
-            openvdb::ax::ast::reprint(*syntaxTree, std::cout);
+            openvdb::ax::ast::reprint(*syntaxTree, os);
         }
         if (opts.mAttribRegPrint) {
             axlog("[INFO] | Printing Attribute Registry\n" << std::flush);
             const openvdb::ax::AttributeRegistry::ConstPtr reg =
                 openvdb::ax::AttributeRegistry::create(*syntaxTree);
-            reg->print(std::cout);
-            std::cout << std::flush;
+            reg->print(os);
+            os << std::flush;
         }
 
         if (!opts.mInitCompile) {
@@ -550,18 +1670,6 @@ main(int argc, char *argv[])
 
     assert(opts.mInitCompile);
 
-    axtimer();
-    axlog("[INFO] Creating Compiler\n");
-    axlog("[INFO] | Optimization Level [" << optLevelToString(opts.mOptLevel) << "]\n" << std::flush);
-    openvdb::ax::CompilerOptions compOpts;
-    compOpts.mOptLevel = opts.mOptLevel;
-
-    openvdb::ax::Compiler::Ptr compiler =
-        openvdb::ax::Compiler::create(compOpts);
-    openvdb::ax::CustomData::Ptr customData =
-        openvdb::ax::CustomData::create();
-    axlog("[INFO] | " << axtime() << '\n' << std::flush);
-
     // Check what we need to compile for if performing execution
 
     if (opts.mMode == ProgOptions::Execute) {
@@ -570,8 +1678,9 @@ main(int argc, char *argv[])
         bool points = false;
         bool volumes = false;
         for (auto grid : *grids) {
-            points |= grid->isType<openvdb::points::PointDataGrid>();
-            volumes |= !points;
+            const bool isPoints = grid->isType<openvdb::points::PointDataGrid>();
+            points |= isPoints;
+            volumes |= !isPoints;
             if (points && volumes) break;
         }
         if (points && volumes) opts.mCompileFor = ProgOptions::Compilation::All;
@@ -579,189 +1688,695 @@ main(int argc, char *argv[])
         else if (volumes)      opts.mCompileFor = ProgOptions::Compilation::Volumes;
     }
 
-    if (opts.mMode == ProgOptions::Analyze) {
+    const bool compilePoints =
+        opts.mCompileFor == ProgOptions::Compilation::All ||
+        opts.mCompileFor == ProgOptions::Compilation::Points;
+    const bool compileVolumes =
+        opts.mCompileFor == ProgOptions::Compilation::All ||
+        opts.mCompileFor == ProgOptions::Compilation::Volumes;
 
-        bool psuccess = true;
+    // Fuse consecutive snippets into as few passes over the data as is legal
 
-        if (opts.mCompileFor == ProgOptions::Compilation::All ||
-            opts.mCompileFor == ProgOptions::Compilation::Points) {
-            axtimer();
-            axlog("[INFO] Compiling for VDB Points\n" << std::flush);
-            try {
-                compiler->compile<openvdb::ax::PointExecutable>(*syntaxTree, logs, customData);
-                if (logs.hasError()) {
-                    axlog("[INFO] Compilation error(s)!\n");
-                    psuccess = false;
-                }
-             }
-            catch (std::exception& e) {
-                psuccess = false;
-                axlog("[INFO] Fatal error!\n");
-                OPENVDB_LOG_ERROR(e.what());
+    struct Pass
+    {
+        std::vector<std::string> mSnippets;
+        bool mDeletes = false;
+        std::unique_ptr<CompileJob<openvdb::ax::PointExecutable>> mPointJob;
+        std::unique_ptr<CompileJob<openvdb::ax::VolumeExecutable>> mVolumeJob;
+    };
+
+    auto check = [&](const auto& job, const std::string& kind, const size_t pass) -> bool {
+        if (!job) return true;
+        job->flush();
+        if (report) {
+            report->mCompilations.push_back({kind, pass, job->mMilliseconds, !job->failed()});
+        }
+        if (!job->mException.empty()) {
+            axlog("[INFO] | " << kind << ": Fatal error!\n");
+            if (opts.mMode == ProgOptions::Execute) {
+                OPENVDB_LOG_FATAL("Fatal error!\nErrors:\n" << job->mException);
             }
-            const bool hasWarning = logs.hasWarning();
-            if (psuccess) {
-                axlog("[INFO] | Compilation successful");
-                if (hasWarning) axlog(" with warning(s)\n");
+            else {
+                OPENVDB_LOG_ERROR(job->mException);
             }
-            axlog("[INFO] | " << axtime() << '\n' << std::flush);
+            return false;
         }
+        if (job->failed()) {
+            axlog("[INFO] | " << kind << ": Compilation error(s)!\n");
+            return false;
+        }
+        axlog("[INFO] | " << kind << ": Compilation successful"
+            << (job->hasWarning() ? " with warning(s)" : "")
+            << " [" << timeString(job->mMilliseconds) << "]\n");
+        return true;
+    };
 
-        bool vsuccess = true;
-
-        if (opts.mCompileFor == ProgOptions::Compilation::All ||
-            opts.mCompileFor == ProgOptions::Compilation::Volumes) {
-            axtimer();
-            axlog("[INFO] Compiling for VDB Volumes\n" << std::flush);
-            try {
-                compiler->compile<openvdb::ax::VolumeExecutable>(*syntaxTree, logs, customData);
-                if (logs.hasError()) {
-                    axlog("[INFO] Compilation error(s)!\n");
-                    vsuccess = false;
-                }
+    // Plan the passes of the parsed snippets and compile them, returning
+    // whether all of them compiled
+    auto compile = [&](const std::vector<openvdb::ax::ast::Tree::ConstPtr>& trees,
+        std::vector<Pass>& passes) -> bool
+    {
+        axtimer();
+        const std::vector<std::vector<size_t>> plan = planPasses(trees, compileVolumes);
+        axreport("registry");
+        passes.clear();
+        for (const std::vector<size_t>& snippets : plan) {
+            passes.emplace_back();
+            for (const size_t i : snippets) {
+                passes.back().mSnippets.emplace_back(opts.mInputCode[i]);
+                passes.back().mDeletes |=
+                    openvdb::ax::ast::callsFunction(*trees[i], "deletepoint");
             }
-            catch (std::exception& e) {
-                vsuccess = false;
-                axlog("[INFO] Fatal error!\n");
-                OPENVDB_LOG_ERROR(e.what());
+        }
+        if (trees.size() > 1) {
+            axlog("[INFO] Fused " << trees.size() << " snippets into " << passes.size()
+                << " pass" << (passes.size() == 1 ? "" : "es") << '\n');
+        }
+
+        axtimer();
+        axlog("[INFO] Creating Compiler" << (compilePoints && compileVolumes ? "s" : "") << '\n');
+        axlog("[INFO] | Optimization Level [" << optLevelToString(opts.mOptLevel) << "]\n"
+            << std::flush);
+        for (Pass& pass : passes) {
+            if (compilePoints) {
+                pass.mPointJob.reset(
+                    new CompileJob<openvdb::ax::PointExecutable>(pass.mSnippets, opts));
             }
-            const bool hasWarning = logs.hasWarning();
-            if (vsuccess) {
-                axlog("[INFO] | Compilation successful");
-                if (hasWarning) axlog(" with warning(s)\n");
+            if (compileVolumes) {
+                pass.mVolumeJob.reset(
+                    new CompileJob<openvdb::ax::VolumeExecutable>(pass.mSnippets, opts));
             }
-            axlog("[INFO] | " << axtime() << '\n' << std::flush);
         }
+        axreport("createCompilers");
+        axlog("[INFO] | " << axtime() << '\n' << std::flush);
 
-        return ((vsuccess && psuccess) ? EXIT_SUCCESS : EXIT_FAILURE);
-    }
+        // Compile every pass for points and volumes concurrently, so that the
+        // latency is that of the slowest compilation rather than the sum of all
 
-    // Execute points
+        axtimer();
+        axlog("[INFO] Compiling for " << (compilePoints && compileVolumes ?
+            "VDB Points and VDB Volumes concurrently" :
+            (compilePoints ? "VDB Points" : "VDB Volumes")) << '\n' << std::flush);
+        {
+            tbb::task_group tasks;
+            for (Pass& pass : passes) {
+                if (pass.mPointJob) tasks.run([&pass]() { pass.mPointJob->run(); });
+                if (pass.mVolumeJob) tasks.run([&pass]() { pass.mVolumeJob->run(); });
+            }
+            tasks.wait();
+        }
+        axreport("compile");
+        const std::string compileTime = axtime();
+
+        bool success = true;
+        for (size_t i = 0; i < passes.size(); ++i) {
+            const std::string suffix = passes.size() == 1 ? "" :
+                " (pass " + std::to_string(i + 1) + ")";
+            success &= check(passes[i].mPointJob, "VDB Points" + suffix, i);
+            success &= check(passes[i].mVolumeJob, "VDB Volumes" + suffix, i);
+        }
+        axlog("[INFO] | " << compileTime << '\n' << std::flush);
+        return success;
+    };
 
-    if (opts.mCompileFor == ProgOptions::Compilation::All ||
-        opts.mCompileFor == ProgOptions::Compilation::Points) {
+    std::vector<Pass> passes;
+    bool success = parsed && compile(syntaxTrees, passes);
 
-        axlog("[INFO] VDB PointDataGrids Found\n" << std::flush);
+    if (opts.mMode == ProgOptions::Analyze || (!success && !opts.mWatch)) {
+        return (success ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
 
-        openvdb::ax::PointExecutable::Ptr pointExe;
+    // The region to which volume execution is restricted, if any. Each frame
+    // makes its own, as the mask may differ from frame to frame.
 
-        axtimer();
+    std::unique_ptr<Region> region;
+    if (!opts.mFrames) {
         try {
-            axlog("[INFO] Compiling for VDB Points\n" << std::flush);
-            pointExe = compiler->compile<openvdb::ax::PointExecutable>(*syntaxTree, logs, customData);
-        } catch (std::exception& e) {
-            OPENVDB_LOG_FATAL("Fatal error!\nErrors:\n" << e.what());
+            region = makeRegion(opts, *grids);
+        }
+        catch (openvdb::Exception& e) {
+            OPENVDB_LOG_FATAL(e.what());
             return EXIT_FAILURE;
         }
+    }
 
-        if (pointExe) {
-            axlog("[INFO] | Compilation successful");
-            if (logs.hasWarning()) {
-                axlog(" with warning(s)\n");
+    // Execute the given passes on the given grids, without logging, as each of
+    // several frames or each run of --watch does
+
+    auto executePass = [&](const Pass& pass,
+        openvdb::GridPtrVec& executeGrids, const Region* executeRegion)
+    {
+        bool hasVolumes = false;
+        for (auto grid : executeGrids) {
+            if (!grid->isType<openvdb::points::PointDataGrid>()) {
+                hasVolumes = true;
+                continue;
             }
-        }
-        else {
-            if (logs.hasError()) {
-                axlog("[INFO] Compilation error(s)!\n");
+            if (!pass.mPointJob) {
+                OPENVDB_THROW(openvdb::RuntimeError, "the code was not compiled for "
+                    "points, as there were none in the input it was compiled for");
+            }
+            openvdb::points::PointDataGrid::Ptr points =
+                openvdb::gridPtrCast<openvdb::points::PointDataGrid>(grid);
+            pass.mPointJob->mExe->execute(*points);
+            if (pass.mDeletes) {
+                deleteDeadPoints(points->tree(), /*count=*/false);
             }
-            return EXIT_FAILURE;
         }
-        axlog("[INFO] | " << axtime() << '\n' << std::flush);
-
-        size_t total = 0, count = 1;
-        if (opts.mVerbose) {
-            for (auto grid : *grids) {
-                if (!grid->isType<openvdb::points::PointDataGrid>()) continue;
-                ++total;
+        if (hasVolumes) {
+            if (!pass.mVolumeJob) {
+                OPENVDB_THROW(openvdb::RuntimeError, "the code was not compiled for "
+                    "volumes, as there were none in the input it was compiled for");
             }
+            RegionScope scope(executeGrids, written, executeRegion);
+            pass.mVolumeJob->mExe->execute(executeGrids);
         }
+    };
 
-        for (auto grid : *grids) {
-            if (!grid->isType<openvdb::points::PointDataGrid>()) continue;
-            openvdb::points::PointDataGrid::Ptr points =
-                openvdb::gridPtrCast<openvdb::points::PointDataGrid>(grid);
-            axtimer();
-            axlog("[INFO] Executing on \"" << points->getName() << "\" "
-                  << count << " of " << total << '\n' << std::flush);
-            ++count;
-
-            try {
-                pointExe->execute(*points);
-                if (openvdb::ax::ast::callsFunction(*syntaxTree, "deletepoint")) {
-                    openvdb::points::deleteFromGroup(points->tree(), "dead", false, false);
+    // Watch the snippet files, executing the code on a fresh snapshot of the
+    // resident input whenever they change. Compiling reuses the initialized
+    // compiler, so a run costs little more than compiling and executing.
+
+    if (opts.mWatch) {
+        const openvdb::GridPtrVec resident = *grids;
+
+        // Changes are detected by content rather than by modification time, as
+        // that may only be recorded to the second, which would miss an edit
+        // that keeps the size of a file within the same second as the last.
+        // Snippet files are small, so reading them each time costs little. A
+        // file that can not be read, e.g. while an editor replaces it, keeps
+        // its previous code.
+        auto readCode = [&opts]() {
+            std::vector<std::string> code = opts.mInputCode;
+            for (size_t i = 0; i < code.size(); ++i) {
+                if (opts.mInputFiles[i].empty()) continue;
+                std::ifstream in(opts.mInputFiles[i], std::ios::in | std::ios::binary);
+                if (in) {
+                    code[i].assign(std::istreambuf_iterator<char>(in),
+                        std::istreambuf_iterator<char>());
                 }
             }
-            catch (std::exception& e) {
-                OPENVDB_LOG_FATAL("Execution error!\nErrors:\n" << e.what());
-                return EXIT_FAILURE;
+            return code;
+        };
+
+        for (;;) {
+            if (success) {
+                openvdb::util::CpuTimer runTimer;
+                try {
+                    openvdb::GridPtrVecPtr snapshot = snapshotGrids(resident, written);
+                    for (const Pass& pass : passes) executePass(pass, *snapshot, region.get());
+                    const double executeTime = runTimer.milliseconds();
+                    if (!opts.mOutputVDBFile.empty()) {
+                        openvdb::io::File(opts.mOutputVDBFile).write(*snapshot, *meta);
+                    }
+                    os << "[INFO] Executed in " << timeString(executeTime);
+                    if (!opts.mOutputVDBFile.empty()) {
+                        os << ", wrote \"" << opts.mOutputVDBFile << "\" in "
+                           << timeString(runTimer.milliseconds() - executeTime);
+                    }
+                    os << '\n';
+                }
+                catch (std::exception& e) {
+                    OPENVDB_LOG_ERROR("Execution error!\nErrors:\n" << e.what());
+                }
             }
+            os << "[INFO] Watching for changes...\n" << std::flush;
 
-            axlog("[INFO] | Execution success.\n");
-            axlog("[INFO] | " << axtime() << '\n' << std::flush);
+            std::vector<std::string> code;
+            while ((code = readCode()) == opts.mInputCode) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+            opts.mInputCode = std::move(code);
+
+            openvdb::util::CpuTimer compileTimer;
+            logs.clear();
+            std::vector<openvdb::ax::ast::Tree::ConstPtr> trees;
+            for (size_t i = 0; i < opts.mInputCode.size(); ++i) {
+                trees.emplace_back(openvdb::ax::ast::parse(opts.mInputCode[i].c_str(), logs));
+                if (!trees.back()) break;
+            }
+            success = trees.back() != nullptr;
+            if (success) {
+                written = accessedNames(*fuseSnippets(trees), /*writesOnly=*/true);
+                success = compile(trees, passes);
+            }
+            os << "[INFO] " << (success ? "Compiled" : "Failed to compile") << " in "
+               << timeString(compileTimer.milliseconds()) << '\n' << std::flush;
         }
     }
 
-    // Execute volumes
-
-    if (opts.mCompileFor == ProgOptions::Compilation::All ||
-        opts.mCompileFor == ProgOptions::Compilation::Volumes) {
+    // Time the execution with increasing numbers of threads, each in an arena
+    // of its own that its parallel loops are confined to
 
-        axlog("[INFO] VDB Volumes Found\n" << std::flush);
+    if (opts.mScaling) {
+        const int available = int(std::min(size_t(tbb::this_task_arena::max_concurrency()),
+            tbb::global_control::active_value(tbb::global_control::max_allowed_parallelism)));
+        const int maxThreads = opts.mScalingThreads > 0 ?
+            std::min(opts.mScalingThreads, available) : available;
+        std::vector<int> counts;
+        for (int threads = 1; threads < maxThreads; threads *= 2) counts.emplace_back(threads);
+        counts.emplace_back(maxThreads);
 
-        openvdb::ax::VolumeExecutable::Ptr volumeExe;
+        os << "[SCALING] threads        time  speedup  efficiency\n" << std::flush;
+        double serial = 0.0;
         try {
-            axlog("[INFO] Compiling for VDB Points\n" << std::flush);
-            volumeExe = compiler->compile<openvdb::ax::VolumeExecutable>(*syntaxTree, logs, customData);
-        } catch (std::exception& e) {
-            OPENVDB_LOG_FATAL("Fatal error!\nErrors:\n" << e.what());
+            for (const int threads : counts) {
+                tbb::task_arena arena(threads);
+                double msec = std::numeric_limits<double>::max();
+                for (size_t run = 0; run < 3; ++run) {
+                    openvdb::GridPtrVecPtr snapshot = snapshotGrids(*grids, written);
+                    openvdb::util::CpuTimer runTimer;
+                    arena.execute([&]() {
+                        for (const Pass& pass : passes) executePass(pass, *snapshot, region.get());
+                    });
+                    msec = std::min(msec, runTimer.milliseconds());
+                }
+                if (threads == 1) serial = msec;
+                const double speedup = msec > 0.0 ? serial / msec : 0.0;
+                os << "[SCALING] " << std::setw(7) << threads << "  " << std::setw(10)
+                   << timeString(msec) << "  " << std::fixed << std::setprecision(2)
+                   << std::setw(7) << speedup << "  " << std::setprecision(1)
+                   << std::setw(9) << (100.0 * speedup / threads) << "%\n" << std::flush;
+                os.unsetf(std::ios_base::floatfield);
+                os << std::setprecision(6);
+            }
+        }
+        catch (std::exception& e) {
+            OPENVDB_LOG_FATAL("Execution error!\nErrors:\n" << e.what());
             return EXIT_FAILURE;
         }
+        return EXIT_SUCCESS;
+    }
 
-        if (volumeExe) {
-            axlog("[INFO] | Compilation successful");
-            if (logs.hasWarning()) {
-                axlog(" with warning(s)\n");            }
+    // Process frames, each of which is read, executed on and written out as a
+    // whole. Each worker processes one frame at a time, so that at most as many
+    // frames as there are workers are held in memory at once. A frame's work is
+    // isolated so that a thread waiting within it does not pick up another frame.
+
+    if (opts.mFrames) {
+        struct Frame
+        {
+            int mFrame = 0;
+            double mRead = 0.0, mExecute = 0.0, mWrite = 0.0;
+            std::string mError;
+        };
+
+        std::vector<Frame> frames(opts.mFrameEnd - opts.mFrameStart + 1);
+        for (size_t i = 0; i < frames.size(); ++i) {
+            frames[i].mFrame = opts.mFrameStart + int(i);
         }
-        else {
-            if (logs.hasError()) {
-                axlog("[INFO] Compilation error(s)!\n");
+
+        const bool passThrough = !opts.mOutputVDBFile.empty();
+
+        auto process = [&](Frame& frame) {
+            openvdb::util::CpuTimer frameTimer;
+            openvdb::io::File file(expandFrame(opts.mInputVDBFile, frame.mFrame));
+            file.open();
+            openvdb::GridPtrVecPtr metadata = file.readAllGridMetadata();
+            openvdb::MetaMap::Ptr fileMeta = file.getMetadata();
+            openvdb::GridPtrVecPtr frameGrids = readGrids(file, *metadata, names, passThrough);
+            file.close();
+            frame.mRead = frameTimer.milliseconds();
+
+            frameTimer.restart();
+            const std::unique_ptr<Region> frameRegion = makeRegion(opts, *frameGrids);
+            for (const Pass& pass : passes) executePass(pass, *frameGrids, frameRegion.get());
+            frame.mExecute = frameTimer.milliseconds();
+
+            if (passThrough) {
+                frameTimer.restart();
+                openvdb::io::File out(expandFrame(opts.mOutputVDBFile, frame.mFrame));
+                out.write(*frameGrids, *fileMeta);
+                frame.mWrite = frameTimer.milliseconds();
             }
-            return EXIT_FAILURE;
+        };
+
+        axtimer();
+        const size_t jobs = std::min(opts.mFrameJobs, frames.size());
+        axlog("[INFO] Processing " << frames.size() << " frame" << (frames.size() == 1 ? "" : "s")
+            << ", " << jobs << " at a time\n" << std::flush);
+
+        std::atomic<size_t> next(0);
+        std::mutex logMutex;
+        tbb::task_group workers;
+        for (size_t j = 0; j < jobs; ++j) {
+            workers.run([&]() {
+                for (size_t i = next++; i < frames.size(); i = next++) {
+                    Frame& frame = frames[i];
+                    try {
+                        tbb::this_task_arena::isolate([&]() { process(frame); });
+                    }
+                    catch (std::exception& e) {
+                        frame.mError = e.what();
+                    }
+                    std::lock_guard<std::mutex> lock(logMutex);
+                    if (!frame.mError.empty()) {
+                        OPENVDB_LOG_ERROR("Frame " << frame.mFrame << " failed: " << frame.mError);
+                        continue;
+                    }
+                    os << "[INFO] Frame " << frame.mFrame << ": "
+                       << timeString(frame.mRead + frame.mExecute + frame.mWrite)
+                       << " (read " << timeString(frame.mRead)
+                       << ", execute " << timeString(frame.mExecute)
+                       << ", write " << timeString(frame.mWrite) << ")\n" << std::flush;
+                }
+            });
         }
-        axlog("[INFO] | " << axtime() << '\n' << std::flush);
+        workers.wait();
 
-        if (opts.mVerbose) {
-            std::vector<const std::string*> names;
-            axlog("[INFO] Executing using:\n");
-            for (auto grid : *grids) {
-                if (grid->isType<openvdb::points::PointDataGrid>()) continue;
-                axlog("  " << grid->getName() << '\n');
-                axlog("    " << grid->valueType() << '\n');
-                axlog("    " << grid->gridClassToString(grid->getGridClass()) << '\n');
+        axreport("frames");
+
+        std::vector<int> failed;
+        for (const Frame& frame : frames) {
+            if (!frame.mError.empty()) failed.emplace_back(frame.mFrame);
+            if (report) {
+                report->mFrames.push_back({frame.mFrame,
+                    frame.mRead, frame.mExecute, frame.mWrite, frame.mError});
             }
-            axlog(std::flush);
         }
+        os << "[INFO] Processed " << (frames.size() - failed.size()) << " of "
+           << frames.size() << " frames: " << axtime() << '\n';
+        if (!failed.empty()) {
+            std::ostringstream list;
+            for (size_t i = 0; i < failed.size(); ++i) list << (i ? ", " : "") << failed[i];
+            OPENVDB_LOG_ERROR("Failed frames: " << list.str());
+        }
+        os << std::flush;
+        return (failed.empty() ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    // Stream grids. Each grid is written to a temporary file of its own once it
+    // has been executed on, and its encoded bytes are then appended to the output
+    // file, whose header and grid count are known up front from the metadata.
 
-        try { volumeExe->execute(*grids); }
+    if (opts.mStream) {
+        const bool writeOutput = !opts.mOutputVDBFile.empty();
+        const std::string tempFile = tempFileName(opts.mOutputVDBFile);
+        std::ofstream output;
+        bool header = false;
+
+        try {
+            if (writeOutput) {
+                output.open(opts.mOutputVDBFile,
+                    std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+                if (!output) {
+                    OPENVDB_THROW(openvdb::IoError, "unable to open " << opts.mOutputVDBFile);
+                }
+            }
+
+            openvdb::io::File file(opts.mInputVDBFile);
+            file.open();
+            auto metaIter = grids->cbegin();
+            for (auto iter = file.beginName(); iter != file.endName(); ++iter, ++metaIter) {
+                // Unreferenced volumes need not be read if they are not written
+                const openvdb::GridBase& metadata = **metaIter;
+                if (!writeOutput &&
+                    !metadata.isType<openvdb::points::PointDataGrid>() &&
+                    metadata.getName() != streamVolume) continue;
+
+                axtimer();
+                axlog("[INFO] Streaming \"" << iter.gridName() << "\"" << std::flush);
+                openvdb::util::CpuTimer phaseTimer;
+                openvdb::GridBase::Ptr grid = file.readGrid(iter.gridName());
+                if (report) report->addPhase("read", phaseTimer.milliseconds());
+                for (size_t p = 0; p < passes.size(); ++p) {
+                    const Pass& pass = passes[p];
+                    phaseTimer.restart();
+                    if (grid->isType<openvdb::points::PointDataGrid>()) {
+                        openvdb::points::PointDataGrid::Ptr points =
+                            openvdb::gridPtrCast<openvdb::points::PointDataGrid>(grid);
+                        const openvdb::Index64 count =
+                            report ? openvdb::points::pointCount(points->constTree()) : 0;
+                        pass.mPointJob->mExe->execute(*points);
+                        if (report) {
+                            report->addPhase("execute", phaseTimer.milliseconds());
+                            report->mExecutions.push_back({"points", p,
+                                phaseTimer.milliseconds(), {{grid->getName(), count}}});
+                        }
+                        if (pass.mDeletes) {
+                            phaseTimer.restart();
+                            const openvdb::Index64 deleted = deleteDeadPoints(points->tree(),
+                                /*count=*/report != nullptr);
+                            if (report) {
+                                // execute includes deletepoint, as in the normal path
+                                report->addPhase("execute", phaseTimer.milliseconds());
+                                report->addPhase("deletepoint", phaseTimer.milliseconds());
+                                report->mDeletions.push_back({grid->getName(), p,
+                                    deleted, phaseTimer.milliseconds()});
+                            }
+                        }
+                    }
+                    else if (!streamVolume.empty() && grid->getName() == streamVolume) {
+                        const openvdb::Index64 count = report ? grid->activeVoxelCount() : 0;
+                        openvdb::GridPtrVec volume(1, grid);
+                        RegionScope scope(volume, written, region.get());
+                        pass.mVolumeJob->mExe->execute(volume);
+                        if (report) {
+                            report->addPhase("execute", phaseTimer.milliseconds());
+                            report->mExecutions.push_back({"volumes", p,
+                                phaseTimer.milliseconds(), {{grid->getName(), count}}});
+                        }
+                    }
+                }
+                if (writeOutput) {
+                    phaseTimer.restart();
+                    openvdb::io::File(tempFile).write(openvdb::GridPtrVec(1, grid), *meta);
+                    std::ifstream temp(tempFile, std::ios_base::in | std::ios_base::binary);
+                    FileLayout layout;
+                    if (!temp || !layout.read(temp) || layout.mGrids.size() != 1) {
+                        OPENVDB_THROW(openvdb::IoError, "unable to read back " << tempFile);
+                    }
+                    // the header and metadata are those that the library has just written
+                    if (!header) {
+                        copyBytes(temp, 0, layout.mCountPos, output);
+                        const int32_t count = int32_t(grids->size());
+                        output.write(reinterpret_cast<const char*>(&count), sizeof(int32_t));
+                        header = true;
+                    }
+                    copyGrid(temp, layout.mGrids.front(), output);
+                    if (!temp || !output) {
+                        OPENVDB_THROW(openvdb::IoError, "error writing " << opts.mOutputVDBFile);
+                    }
+                    if (report) report->addPhase("write", phaseTimer.milliseconds());
+                }
+                axlog(": " << axtime() << '\n' << std::flush);
+            }
+            file.close();
+            std::remove(tempFile.c_str());
+
+            if (writeOutput) {
+                output.close();
+                // with no grids, there was no temporary file to take the header from
+                if (!header) openvdb::io::File(opts.mOutputVDBFile).write(*grids, *meta);
+                else if (!output) {
+                    OPENVDB_THROW(openvdb::IoError, "error writing " << opts.mOutputVDBFile);
+                }
+            }
+        }
         catch (std::exception& e) {
             OPENVDB_LOG_FATAL("Execution error!\nErrors:\n" << e.what());
+            std::remove(tempFile.c_str());
+            if (writeOutput) {
+                output.close();
+                std::remove(opts.mOutputVDBFile.c_str());
+            }
             return EXIT_FAILURE;
         }
+        return EXIT_SUCCESS;
+    }
 
-        axlog("[INFO] | Execution success.\n");
-        axlog("[INFO] | " << axtime() << '\n' << std::flush);
+    // Execute each pass in turn
+
+    for (size_t passIdx = 0; passIdx < passes.size(); ++passIdx) {
+        const Pass& pass = passes[passIdx];
+        if (passes.size() > 1) {
+            axlog("[INFO] Pass " << (passIdx + 1) << " of " << passes.size() << '\n');
+        }
+
+        // Execute points
+
+        if (opts.mCompileFor == ProgOptions::Compilation::All ||
+            opts.mCompileFor == ProgOptions::Compilation::Points) {
+
+            axlog("[INFO] VDB PointDataGrids Found\n" << std::flush);
+
+            const openvdb::ax::PointExecutable::Ptr& pointExe = pass.mPointJob->mExe;
+
+            struct PointTask
+            {
+                openvdb::points::PointDataGrid::Ptr mGrid;
+                openvdb::Index64 mPoints = 0, mRemaining = 0;
+                double mMilliseconds = 0.0, mDeleteMilliseconds = 0.0;
+                std::string mError;
+            };
+
+            // Schedule the largest grids first, so that small grids fill in
+            // around them rather than leaving a large one to run on its own
+            std::vector<PointTask> tasks;
+            for (auto grid : *grids) {
+                if (!grid->isType<openvdb::points::PointDataGrid>()) continue;
+                tasks.emplace_back();
+                tasks.back().mGrid = openvdb::gridPtrCast<openvdb::points::PointDataGrid>(grid);
+                tasks.back().mPoints = openvdb::points::pointCount(tasks.back().mGrid->constTree());
+            }
+            std::stable_sort(tasks.begin(), tasks.end(),
+                [](const PointTask& a, const PointTask& b) { return a.mPoints > b.mPoints; });
+
+            const bool deletes = pass.mDeletes;
+            // The number of points deleted is only logged and reported.
+            const bool countDeleted = opts.mVerbose || report;
+
+            // Execute each grid as a task of its own; each execution is itself
+            // parallel over the grid's leaves. The deletion of a grid's dead points
+            // follows its execution within the same task, so that it overlaps the
+            // execution of the other grids.
+
+            axtimer();
+            axlog("[INFO] Executing on " << tasks.size() << " PointDataGrid"
+                << (tasks.size() == 1 ? "" : "s") << '\n' << std::flush);
+
+            tbb::parallel_for(size_t(0), tasks.size(), [&](size_t i) {
+                PointTask& task = tasks[i];
+                openvdb::util::CpuTimer taskTimer;
+                try {
+                    pointExe->execute(*task.mGrid);
+                    task.mMilliseconds = taskTimer.milliseconds();
+                    task.mRemaining = task.mPoints;
+                    if (deletes) {
+                        taskTimer.restart();
+                        task.mRemaining -= deleteDeadPoints(task.mGrid->tree(), countDeleted);
+                        task.mDeleteMilliseconds = taskTimer.milliseconds();
+                    }
+                }
+                catch (std::exception& e) {
+                    task.mError = e.what();
+                    task.mMilliseconds = taskTimer.milliseconds();
+                }
+            });
+
+            // The deletion of a grid's points overlaps the execution of the
+            // others, so it can not be taken out of the execute phase; the
+            // deletepoint phase is the sum of each grid's deletion time.
+            const double msec = timer.milliseconds();
+            if (report) {
+                report->addPhase("execute", msec);
+                if (deletes) {
+                    double deleteMsec = 0.0;
+                    for (const PointTask& task : tasks) deleteMsec += task.mDeleteMilliseconds;
+                    report->addPhase("deletepoint", deleteMsec);
+                }
+            }
+
+            openvdb::Index64 totalPoints = 0;
+            for (const PointTask& task : tasks) {
+                if (!task.mError.empty()) {
+                    OPENVDB_LOG_FATAL("Execution error on \"" << task.mGrid->getName()
+                        << "\"!\nErrors:\n" << task.mError);
+                    return EXIT_FAILURE;
+                }
+                totalPoints += task.mPoints;
+                axlog("[INFO] | \"" << task.mGrid->getName() << "\": "
+                    << task.mPoints << " points");
+                if (deletes) axlog(" (" << (task.mPoints - task.mRemaining) << " deleted)");
+                axlog(" [" << timeString(task.mMilliseconds) << ", "
+                    << rateString(task.mPoints, task.mMilliseconds) << " points/sec]\n");
+                if (report) {
+                    report->mExecutions.push_back({"points", passIdx, task.mMilliseconds,
+                        {{task.mGrid->getName(), task.mPoints}}});
+                    if (deletes) {
+                        report->mDeletions.push_back({task.mGrid->getName(), passIdx,
+                            task.mPoints - task.mRemaining, task.mDeleteMilliseconds});
+                    }
+                }
+            }
+
+            axlog("[INFO] | Execution success.\n");
+            axlog("[INFO] | " << timeString(msec) << ", " << totalPoints << " points, "
+                << rateString(totalPoints, msec) << " points/sec\n" << std::flush);
+        }
+
+        // Execute volumes
+
+        if (opts.mCompileFor == ProgOptions::Compilation::All ||
+            opts.mCompileFor == ProgOptions::Compilation::Volumes) {
+
+            axlog("[INFO] VDB Volumes Found\n" << std::flush);
+
+            const openvdb::ax::VolumeExecutable::Ptr& volumeExe = pass.mVolumeJob->mExe;
+
+            if (opts.mVerbose) {
+                std::vector<const std::string*> names;
+                axlog("[INFO] Executing using:\n");
+                for (auto grid : *grids) {
+                    if (grid->isType<openvdb::points::PointDataGrid>()) continue;
+                    axlog("  " << grid->getName() << '\n');
+                    axlog("    " << grid->valueType() << '\n');
+                    axlog("    " << grid->gridClassToString(grid->getGridClass()) << '\n');
+                }
+                axlog(std::flush);
+            }
+
+            Report::Execution execution{"volumes", passIdx, 0.0, {}};
+            if (report) {
+                for (auto grid : *grids) {
+                    if (grid->isType<openvdb::points::PointDataGrid>()) continue;
+                    execution.mGrids.emplace_back(grid->getName(), grid->activeVoxelCount());
+                }
+            }
+
+            axtimer();
+            try {
+                RegionScope scope(*grids, written, region.get());
+                if (region) {
+                    axlog("[INFO] Skipping " << scope.leafCount() << " leaf nodes and "
+                        << scope.tileCount() << " tiles outside the region\n" << std::flush);
+                }
+                volumeExe->execute(*grids);
+            }
+            catch (std::exception& e) {
+                OPENVDB_LOG_FATAL("Execution error!\nErrors:\n" << e.what());
+                return EXIT_FAILURE;
+            }
+
+            if (report) {
+                execution.mMilliseconds = timer.milliseconds();
+                report->addPhase("execute", execution.mMilliseconds);
+                report->mExecutions.emplace_back(std::move(execution));
+            }
+
+            axlog("[INFO] | Execution success.\n");
+            axlog("[INFO] | " << axtime() << '\n' << std::flush);
+        }
     }
 
     if (!opts.mOutputVDBFile.empty()) {
         axtimer();
         axlog("[INFO] Writing results" << std::flush);
+
+        // Volumes that the code does not write to are as they were read. Point
+        // grids are conservatively taken to be modified, as are new grids.
+        std::vector<std::string> source(grids->size());
+        for (size_t i = 0; i < grids->size(); ++i) {
+            const openvdb::GridBase::Ptr& grid = (*grids)[i];
+            if (grid->isType<openvdb::points::PointDataGrid>()) continue;
+            if (written.count(grid->getName())) continue;
+            const auto iter = std::find(inputGrids.cbegin(), inputGrids.cend(), grid);
+            if (iter != inputGrids.cend()) source[i] = inputNames[iter - inputGrids.cbegin()];
+        }
+
         openvdb::io::File out(opts.mOutputVDBFile);
         try {
-            out.write(*grids, *meta);
+            const int copied = writeCopyingUnmodified(opts.mInputVDBFile,
+                opts.mOutputVDBFile, *grids, source, *meta);
+            if (copied < 0) out.write(*grids, *meta);
+            else axlog(" (copied " << copied << " unmodified grid"
+                << (copied == 1 ? "" : "s") << ")");
+            axlog('\n');
         } catch (openvdb::Exception& e) {
             OPENVDB_LOG_ERROR(e.what() << " (" << out.filename() << ")");
             return EXIT_FAILURE;
         }
+        axreport("write");
         axlog("[INFO] | " << axtime() << '\n' << std::flush);
     }
 
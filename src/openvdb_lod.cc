@@ -2,29 +2,60 @@
 // SPDX-License-Identifier: MPL-2.0
 
 #include <openvdb/openvdb.h>
+#include <openvdb/io/Compression.h> // for io::compressionToString()
+#include <openvdb/io/Stream.h>
+#include <openvdb/points/PointCount.h>
+#include <openvdb/points/PointDataGrid.h>
+#include <openvdb/points/PointDelete.h>
+#include <openvdb/points/PointGroup.h>
+#include <openvdb/tools/LevelSetSphere.h>
 #include <openvdb/tools/MultiResGrid.h>
+#include <openvdb/tools/Prune.h>
+#include <openvdb/tools/SignedFloodFill.h>
+#include <openvdb/tree/LeafManager.h>
+#include <openvdb/tree/ValueAccessor.h>
 #include <openvdb/util/CpuTimer.h>
 #include <openvdb/util/logging.h>
 #include <boost/algorithm/string/classification.hpp> // for boost::is_any_of()
 #include <boost/algorithm/string/split.hpp>
-#include <cstdlib> // for std::atof()
+#include <tbb/parallel_for.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#include <algorithm> // for std::min(), std::max()
+#include <cmath> // for std::abs(), std::floor(), std::ldexp(), std::pow()
+#include <cstdint>
+#include <cstdlib> // for std::atof(), std::strtod()
+#include <fstream>
+#include <functional> // for std::function, std::greater
 #include <iomanip> // for std::setprecision()
 #include <iostream>
+#include <map>
+#include <memory>
 #include <set>
 #include <sstream>
 #include <stdexcept> // for std::runtime_error
 #include <string>
+#include <type_traits>
+#include <vector>
+#ifndef _WIN32
+#include <sys/resource.h> // for getrusage()
+#endif
 
 
 namespace {
 
 const char* gProgName = "";
 
+/// Name of the metadata field that records the mip level of each output grid
+const char* const sLevelMetaName = "lod_level";
+
 inline void
 usage [[noreturn]] (int exitStatus = EXIT_FAILURE)
 {
     std::cerr <<
 "Usage: " << gProgName << " in.vdb out.vdb -range FROM[-TO[:STEP]] [options]\n" <<
+"       " << gProgName << " -benchmark [-range FROM[-TO[:STEP]]] [options]\n" <<
 "Which: generates a volume mipmap from an OpenVDB grid\n" <<
 "Where:\n" <<
 "    FROM  is the highest-resolution mip level to be generated\n" <<
@@ -41,10 +72,48 @@ usage [[noreturn]] (int exitStatus = EXIT_FAILURE)
 "                       \"NAME_level_N\", where NAME is the original grid name\n" <<
 "                       and N is the level number, e.g., \"density_level_0\")\n" <<
 "    -nopreserve        cancel an earlier -p or -preserve option\n" <<
+"    -shard             write each mip level to its own file, OUT_level_N.vdb,\n" <<
+"                       where OUT is out.vdb without its extension, and write\n" <<
+"                       a JSON manifest of the levels, coarsest first, to\n" <<
+"                       OUT_manifest.json; grids that are passed through are\n" <<
+"                       written to out.vdb\n" <<
+"    -noshard           cancel an earlier -shard option\n" <<
+"    -compress L=C[,L=C,...]\n" <<
+"                       storage of mip level L (a level number, or \"*\" for all\n" <<
+"                       other levels), where C is \"none\", \"zip\" or \"blosc\",\n" <<
+"                       optionally followed by \"+half\" to save floating-point\n" <<
+"                       values at half precision, e.g., \"0=blosc+half,*=none\"\n" <<
+"                       (default: the library's default compression, full precision);\n" <<
+"                       without -shard, all levels share the compression for \"*\"\n" <<
+"                       and sizes and write times are reported only for the file\n" <<
+"    -pool              reuse the leaf nodes of discarded intermediate levels\n" <<
+"                       for subsequent levels and grids, and release them all\n" <<
+"                       at exit (with -filter other than \"linear\" only); only\n" <<
+"                       levels that are not output are recycled, so a range\n" <<
+"                       with STEP 1 gets no reuse, and the leaves are still\n" <<
+"                       freed one by one, just not while levels are generated\n" <<
+"    -nopool            cancel an earlier -pool option\n" <<
+"    -filter S          kernel used to reduce each integer level from the previous\n" <<
+"                       one: \"linear\" (trilinear restriction), \"box\" (average),\n" <<
+"                       \"min\", \"max\" or \"sdf\" (keep the value nearest the zero\n" <<
+"                       crossing, for level sets); all kernels but \"linear\" require\n" <<
+"                       integer FROM and STEP values; they copy active tiles to\n" <<
+"                       the coarser level as tiles rather than densifying them,\n" <<
+"                       and report the resulting number of leaf nodes per level\n" <<
+"                       (default: linear, which densifies active tiles)\n" <<
+"    -benchmark         instead of reading and writing files, mipmap synthetic\n" <<
+"                       level set spheres, a noise-filled fog volume and a sparse\n" <<
+"                       vector field generated in memory (default range: 0-4),\n" <<
+"                       and print timings and memory usage as JSON\n" <<
 "    -version           print version information\n" <<
 "\n" <<
 "Mip level 0 is the input grid.  Each successive integer level is half\n" <<
 "the resolution of the previous level.  Fractional levels are supported.\n" <<
+"Point data grids are decimated instead: each integer level keeps about\n" <<
+"one eighth of the points of the previous level, with all their attributes.\n" <<
+"The selection is stable across runs (and, given an \"id\" attribute,\n" <<
+"across frames), and the points of each level are a subset of those of\n" <<
+"every finer level.\n" <<
 "\n" <<
 "Examples:\n" <<
 "    Generate levels 0, 1, and 2 (full resolution, half resolution,\n" <<
@@ -67,17 +136,76 @@ usage [[noreturn]] (int exitStatus = EXIT_FAILURE)
 "    as the original grids:\n" <<
 "\n" <<
 "        " << gProgName << " in.vdb out.vdb -range 1.5 -name '[1],velocity' -p\n" <<
+"\n" <<
+"    Generate levels 0 through 4, one file per level, storing level 0 with\n" <<
+"    Blosc compression at half precision and the coarser levels uncompressed:\n" <<
+"\n" <<
+"        " << gProgName << " in.vdb out.vdb -range 0-4 -shard -compress '0=blosc+half,*=none'\n" <<
+"\n" <<
+"    Measure the throughput of the \"box\" kernel on this machine:\n" <<
+"\n" <<
+"        " << gProgName << " -benchmark -range 0-4 -filter box\n" <<
 "\n";
     exit(exitStatus);
 }
 
 
+/// Kernels with which integer mip levels may be reduced
+enum class Filter { Linear, Box, Min, Max, Sdf };
+
+
+/// How the grids of a mip level are stored on disk
+struct Storage
+{
+    Storage(): compression(openvdb::io::Archive::DEFAULT_COMPRESSION_FLAGS), half(false) {}
+
+    uint32_t compression; ///< io::COMPRESS_* flags
+    bool half;            ///< if true, save floating-point values at half precision
+};
+
+
+/// Time spent in each phase of mipmapping a grid, and statistics for each level
+struct Timings
+{
+    struct Level
+    {
+        double level;
+        openvdb::Index64 voxels; ///< number of active voxels
+        double seconds;          ///< time spent generating the level
+    };
+
+    Timings(): restrictSecs(0.0), createSecs(0.0) {}
+
+    double restrictSecs; ///< time spent reducing levels from finer levels
+    double createSecs;   ///< time spent creating the output grids from the reduced levels
+    std::vector<Level> levels;
+};
+
+
 struct Options
 {
-    Options(): from(0.0), to(0.0), step(1.0), keep(false), preserve(false) {}
+    Options(): from(0.0), to(0.0), step(1.0), keep(false), preserve(false),
+        shard(false), pool(false), filter(Filter::Linear), timings(nullptr) {}
+
+    /// @brief Return the storage policy for the given mip level.
+    /// @details Levels are matched with a tolerance, since those of output grids
+    /// are accumulated in steps and recorded in single-precision metadata.
+    const Storage& storage(double level) const
+    {
+        for (const auto& iter: levelStorage) {
+            if (std::abs(iter.first - level) <= 1.0e-5 * std::max(1.0, level)) {
+                return iter.second;
+            }
+        }
+        return defaultStorage;
+    }
 
     double from, to, step;
-    bool keep, preserve;
+    bool keep, preserve, shard, pool;
+    Filter filter;
+    std::map<double, Storage> levelStorage;
+    Storage defaultStorage;
+    Timings* timings; ///< if non-null, record the timings of each grid that is mipmapped
 };
 
 
@@ -114,41 +242,767 @@ parseRangeSpec(const std::string& rangeSpec, Options& opts)
 }
 
 
+/// @brief Parse a string of the form "L=C[+half],L=C[+half],..." and populate
+/// the storage policies of the given @a opts with the resulting values.
+/// @throw std::runtime_error if parsing fails for any reason
+inline void
+parseStorageSpec(const std::string& storageSpec, Options& opts)
+{
+    using namespace openvdb;
+
+    std::vector<std::string> items;
+    boost::split(items, storageSpec, boost::is_any_of(","));
+    for (const std::string& item: items) {
+        // Split on the "=" character, of which there should be exactly one.
+        std::vector<std::string> fields;
+        boost::split(fields, item, boost::is_any_of("="));
+        if (fields.size() != 2 || fields[0].empty()) throw std::runtime_error("");
+
+        // Split the codec on the "+" character.
+        std::vector<std::string> codec;
+        boost::split(codec, fields[1], boost::is_any_of("+"));
+
+        Storage storage;
+        if (codec[0] == "none") {
+            storage.compression = io::COMPRESS_NONE;
+        } else if (codec[0] == "zip") {
+            storage.compression = io::COMPRESS_ZIP | io::COMPRESS_ACTIVE_MASK;
+        } else if (codec[0] == "blosc") {
+            if (!io::Archive::hasBloscCompression()) {
+                throw std::runtime_error("this build of OpenVDB does not support Blosc");
+            }
+            storage.compression = io::COMPRESS_BLOSC | io::COMPRESS_ACTIVE_MASK;
+        } else {
+            throw std::runtime_error("");
+        }
+        for (size_t i = 1; i < codec.size(); ++i) {
+            if (codec[i] != "half") throw std::runtime_error("");
+            storage.half = true;
+        }
+
+        if (fields[0] == "*") {
+            opts.defaultStorage = storage;
+        } else {
+            // The level must be a number in its entirety.
+            char* end = nullptr;
+            const double level = std::strtod(fields[0].c_str(), &end);
+            if (*end != '\0' || !(level >= 0.0)) throw std::runtime_error("");
+            opts.levelStorage[level] = storage;
+        }
+    }
+}
+
+
+/// @brief Return the reduction kernel named by the given string.
+/// @throw std::runtime_error if the string does not name a kernel
+inline Filter
+parseFilter(const std::string& name)
+{
+    if (name == "linear") return Filter::Linear;
+    if (name == "box") return Filter::Box;
+    if (name == "min") return Filter::Min;
+    if (name == "max") return Filter::Max;
+    if (name == "sdf") return Filter::Sdf;
+    throw std::runtime_error("");
+}
+
+
+/// @brief Return the name of the given reduction kernel.
+inline const char*
+filterName(Filter filter)
+{
+    switch (filter) {
+        case Filter::Linear: break;
+        case Filter::Box: return "box";
+        case Filter::Min: return "min";
+        case Filter::Max: return "max";
+        case Filter::Sdf: return "sdf";
+    }
+    return "linear";
+}
+
+
+////////////////////////////////////////
+
+
+// Component-wise minimum and maximum, and ordering by magnitude,
+// for both scalar and vector values.
+template<typename T> inline T minOf(const T& a, const T& b) { return std::min(a, b); }
+template<typename T> inline T maxOf(const T& a, const T& b) { return std::max(a, b); }
+template<typename T> inline bool absLess(const T& a, const T& b)
+{
+    return openvdb::math::Abs(a) < openvdb::math::Abs(b);
+}
+
+template<typename T> inline openvdb::math::Vec3<T>
+minOf(const openvdb::math::Vec3<T>& a, const openvdb::math::Vec3<T>& b)
+{
+    return openvdb::math::minComponent(a, b);
+}
+template<typename T> inline openvdb::math::Vec3<T>
+maxOf(const openvdb::math::Vec3<T>& a, const openvdb::math::Vec3<T>& b)
+{
+    return openvdb::math::maxComponent(a, b);
+}
+template<typename T> inline bool
+absLess(const openvdb::math::Vec3<T>& a, const openvdb::math::Vec3<T>& b)
+{
+    return a.lengthSqr() < b.lengthSqr();
+}
+
+
+// Each reduction kernel combines the eight children of a coarse voxel
+// pairwise and then finishes the result.  The __m256 overloads process
+// eight float lanes at a time.
+
+struct BoxReduce
+{
+    template<typename T> static T combine(const T& a, const T& b) { return a + b; }
+    template<typename T> static T finish(const T& a) { return T(a * 0.125); }
+#if defined(__AVX2__)
+    static __m256 combine(__m256 a, __m256 b) { return _mm256_add_ps(a, b); }
+    static __m256 finish(__m256 a) { return _mm256_mul_ps(a, _mm256_set1_ps(0.125f)); }
+#endif
+};
+
+struct MinReduce
+{
+    template<typename T> static T combine(const T& a, const T& b) { return minOf(a, b); }
+    template<typename T> static T finish(const T& a) { return a; }
+#if defined(__AVX2__)
+    static __m256 combine(__m256 a, __m256 b) { return _mm256_min_ps(a, b); }
+    static __m256 finish(__m256 a) { return a; }
+#endif
+};
+
+struct MaxReduce
+{
+    template<typename T> static T combine(const T& a, const T& b) { return maxOf(a, b); }
+    template<typename T> static T finish(const T& a) { return a; }
+#if defined(__AVX2__)
+    static __m256 combine(__m256 a, __m256 b) { return _mm256_max_ps(a, b); }
+    static __m256 finish(__m256 a) { return a; }
+#endif
+};
+
+/// Conservative level set kernel: keep the child value of smallest magnitude,
+/// together with its sign, so that the zero crossing survives the reduction.
+struct SdfReduce
+{
+    template<typename T> static T combine(const T& a, const T& b) { return absLess(b, a) ? b : a; }
+    template<typename T> static T finish(const T& a) { return a; }
+#if defined(__AVX2__)
+    static __m256 combine(__m256 a, __m256 b)
+    {
+        const __m256 sign = _mm256_set1_ps(-0.0f);
+        const __m256 closer = _mm256_cmp_ps(
+            _mm256_andnot_ps(sign, b), _mm256_andnot_ps(sign, a), _CMP_LT_OQ);
+        return _mm256_blendv_ps(a, b, closer);
+    }
+    static __m256 finish(__m256 a) { return a; }
+#endif
+};
+
+
+/// @brief Reduce the 8³ values of a fine leaf buffer @a src to 4³ values
+/// and write them into the coarse leaf buffer @a dst, starting at linear
+/// offset @a dstOffset (the offset of one of the coarse leaf's octants).
+template<typename OpT, typename ValueT>
+inline void
+reduceOctant(const ValueT* src, ValueT* dst, openvdb::Index dstOffset)
+{
+    // Leaf buffers are laid out x-major: offset = (x << 6) + (y << 3) + z.
+    for (openvdb::Index i = 0; i < 4; ++i) {
+        for (openvdb::Index j = 0; j < 4; ++j) {
+            const ValueT* row = src + (i << 7) + (j << 4);
+            ValueT* out = dst + dstOffset + (i << 6) + (j << 3);
+            for (openvdb::Index k = 0; k < 4; ++k, row += 2) {
+                out[k] = OpT::finish(OpT::combine(
+                    OpT::combine(OpT::combine(row[0], row[1]), OpT::combine(row[8], row[9])),
+                    OpT::combine(OpT::combine(row[64], row[65]), OpT::combine(row[72], row[73]))));
+            }
+        }
+    }
+}
+
+#if defined(__AVX2__)
+template<typename OpT>
+inline void
+reduceOctant(const float* src, float* dst, openvdb::Index dstOffset)
+{
+    // Permutation that gathers the even lanes into the low 128 bits
+    const __m256i evenLanes = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+
+    for (openvdb::Index i = 0; i < 4; ++i) {
+        for (openvdb::Index j = 0; j < 4; ++j) {
+            // Combine the four z rows of a 2×2×8 block...
+            const float* row = src + (i << 7) + (j << 4);
+            __m256 v = OpT::combine(
+                OpT::combine(_mm256_loadu_ps(row), _mm256_loadu_ps(row + 8)),
+                OpT::combine(_mm256_loadu_ps(row + 64), _mm256_loadu_ps(row + 72)));
+            // ...then adjacent pairs of lanes, leaving the results in the even lanes.
+            v = OpT::combine(v, _mm256_permute_ps(v, _MM_SHUFFLE(2, 3, 0, 1)));
+            v = OpT::finish(_mm256_permutevar8x32_ps(v, evenLanes));
+            _mm_storeu_ps(dst + dstOffset + (i << 6) + (j << 3), _mm256_castps256_ps128(v));
+        }
+    }
+}
+#endif
+
+
+/// @brief Compute the values and active states of a coarse leaf from the
+/// (up to) eight leaves of the next finer level that it covers.
+template<typename OpT, typename TreeT>
+inline void
+restrictLeaf(const TreeT& fine, typename TreeT::LeafNodeType& leaf)
+{
+    using namespace openvdb;
+    using LeafT = typename TreeT::LeafNodeType;
+    using ValueT = typename TreeT::ValueType;
+
+    static_assert(LeafT::DIM == 8, "reduction kernels require 8³ leaf nodes");
+    const Int32 half = LeafT::DIM >> 1;
+
+    ValueT* dst = leaf.buffer().data();
+    for (Int32 n = 0; n < 8; ++n) {
+        // Local coordinates of the octant within the coarse leaf
+        const Coord octant(((n >> 2) & 1) * half, ((n >> 1) & 1) * half, (n & 1) * half);
+        const Index dstOffset = LeafT::coordToOffset(octant);
+        const Coord fineOrigin = (leaf.origin() + octant) << 1;
+
+        if (const LeafT* fineLeaf = fine.probeConstLeaf(fineOrigin)) {
+            reduceOctant<OpT>(fineLeaf->buffer().data(), dst, dstOffset);
+            // A coarse voxel is active if any of its children is active.
+            for (auto iter = fineLeaf->cbeginValueOn(); iter; ++iter) {
+                const Coord xyz = octant + (LeafT::offsetToLocalCoord(iter.pos()) >> 1);
+                leaf.setActiveState(LeafT::coordToOffset(xyz), true);
+            }
+        } else {
+            // The octant lies in a tile or in the background, so it is constant.
+            const ValueT value = fine.getValue(fineOrigin);
+            const bool active = fine.isValueOn(fineOrigin);
+            for (Int32 i = 0; i < half; ++i) {
+                for (Int32 j = 0; j < half; ++j) {
+                    for (Int32 k = 0; k < half; ++k) {
+                        const Index offset = dstOffset + (i << 6) + (j << 3) + k;
+                        dst[offset] = value;
+                        leaf.setActiveState(offset, active);
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+/// Numbers of leaf nodes allocated for, reused by and recycled from mip levels
+struct LeafCounts
+{
+    LeafCounts(): allocated(0), reused(0), recycled(0) {}
+    uint64_t allocated, reused, recycled;
+};
+
+LeafCounts sLeafCounts;
+
+/// Functions that release the leaf nodes held by each LeafPool
+std::vector<std::function<void()>> sLeafPoolReleasers;
+
+
+/// @brief Pool of leaf nodes of a given type, shared by the mip levels of
+/// all grids in a run
+/// @details Instead of freeing the leaves of an intermediate level one by one
+/// when it is discarded, the level is recycled into the pool, and the next
+/// levels take their leaves from the pool before allocating new ones.
+/// The pooled leaves are released together by releaseLeafPools(), though still
+/// freed one at a time, as each must be individually deletable by the trees
+/// that take it.  Levels that are output are never recycled, so without an
+/// intermediate level that is not output (i.e., with a STEP of 1), no leaves
+/// are reused.
+/// Leaves are acquired only while the topology of a level is being built,
+/// which is done serially, so no locking is required.
+template<typename LeafT>
+class LeafPool
+{
+public:
+    using ValueType = typename LeafT::ValueType;
+
+    static LeafPool& instance()
+    {
+        static LeafPool sPool;
+        return sPool;
+    }
+
+    ~LeafPool() { this->release(); }
+
+    /// @brief Return an inactive leaf with the given origin, whose values
+    /// are to be overwritten.
+    LeafT* acquire(const openvdb::Coord& origin, const ValueType& background)
+    {
+        if (mLeaves.empty()) {
+            ++sLeafCounts.allocated;
+            return new LeafT(origin, background);
+        }
+        ++sLeafCounts.reused;
+        LeafT* leaf = mLeaves.back();
+        mLeaves.pop_back();
+        leaf->setOrigin(origin);
+        leaf->setValuesOff();
+        return leaf;
+    }
+
+    /// Transfer ownership of all of the leaves of the given tree to this pool.
+    template<typename TreeT>
+    void recycle(TreeT& tree)
+    {
+        const size_t count = mLeaves.size();
+        tree.stealNodes(mLeaves);
+        sLeafCounts.recycled += mLeaves.size() - count;
+    }
+
+    /// Free all pooled leaves.
+    void release()
+    {
+        for (LeafT* leaf: mLeaves) delete leaf;
+        mLeaves.clear();
+        mLeaves.shrink_to_fit();
+    }
+
+private:
+    LeafPool() { sLeafPoolReleasers.push_back([this]() { this->release(); }); }
+
+    std::vector<LeafT*> mLeaves;
+};
+
+
+/// Free the leaf nodes held by all leaf pools.
+inline void
+releaseLeafPools()
+{
+    for (const auto& release: sLeafPoolReleasers) release();
+}
+
+
+// Level set cleanup is meaningful only for scalar, floating-point trees.
+template<typename TreeT>
+inline void
+rebuildLevelSet(TreeT& tree, std::true_type)
+{
+    openvdb::tools::signedFloodFill(tree);
+    openvdb::tools::pruneLevelSet(tree);
+}
+
+template<typename TreeT>
+inline void rebuildLevelSet(TreeT&, std::false_type) {}
+
+
+/// @brief Return a new tree at half the resolution of @a fine, each of whose
+/// voxels is the reduction by @c OpT of a 2×2×2 block of voxels of @a fine.
+/// @details Active tiles of @a fine that span at least two coarse leaves are
+/// constant blocks at the coarser level too, so they are copied as tiles rather
+/// than densified into leaves, and only genuine leaf data is filtered.
+/// @param fine           the next finer level
+/// @param isLevelSet     if true, restore the sign of the coarse level's background
+/// @param usePool        if true, take the coarse leaves from a LeafPool
+/// @param tileLeafCount  set to the number of coarse leaves that the tiles
+///                       copied from @a fine would have occupied if densified
+template<typename OpT, typename TreeT>
+inline typename TreeT::Ptr
+restrictWith(const TreeT& fine, bool isLevelSet, bool usePool, openvdb::Index64& tileLeafCount)
+{
+    using namespace openvdb;
+    using LeafT = typename TreeT::LeafNodeType;
+
+    typename TreeT::Ptr coarse(new TreeT(fine.background()));
+
+    LeafPool<LeafT>* pool = (usePool ? &LeafPool<LeafT>::instance() : nullptr);
+    tree::ValueAccessor<TreeT> acc(*coarse);
+    auto touchLeaf = [&](const Coord& ijk) {
+        const Coord origin = ijk & ~Int32(LeafT::DIM - 1);
+        if (acc.probeConstLeaf(origin)) return;
+        if (pool) {
+            acc.addLeaf(pool->acquire(origin, fine.background()));
+        } else {
+            ++sLeafCounts.allocated;
+            acc.addLeaf(new LeafT(origin, fine.background()));
+        }
+    };
+
+    // Allocate the coarse leaves, each of which covers eight fine leaves.
+    for (auto iter = fine.cbeginLeaf(); iter; ++iter) {
+        touchLeaf(iter->origin() >> 1);
+    }
+
+    // A fine tile that is no larger than a leaf covers only part of a coarse leaf,
+    // so it is densified.  Larger tiles are aligned to their own size, so they
+    // reduce to blocks of whole coarse leaves, which share no voxels with the
+    // leaves allocated above.  Their values are uniform, so every kernel
+    // reduces them to the same value.
+    tileLeafCount = 0;
+    std::vector<std::pair<CoordBBox, typename TreeT::ValueType>> tiles;
+    CoordBBox bbox;
+    typename TreeT::ValueOnCIter tileIter = fine.cbeginValueOn();
+    tileIter.setMaxDepth(TreeT::ValueOnCIter::LEAF_DEPTH - 1);
+    for ( ; tileIter; ++tileIter) {
+        tileIter.getBoundingBox(bbox);
+        if (bbox.dim()[0] > Int32(LeafT::DIM)) {
+            const CoordBBox half(bbox.min() >> 1, bbox.max() >> 1);
+            tiles.emplace_back(half, tileIter.getValue());
+            tileLeafCount += half.volume() / LeafT::NUM_VALUES;
+            continue;
+        }
+        const Coord lo = (bbox.min() >> 1) & ~Int32(LeafT::DIM - 1), hi = bbox.max() >> 1;
+        Coord ijk;
+        for (ijk[0] = lo[0]; ijk[0] <= hi[0]; ijk[0] += LeafT::DIM) {
+            for (ijk[1] = lo[1]; ijk[1] <= hi[1]; ijk[1] += LeafT::DIM) {
+                for (ijk[2] = lo[2]; ijk[2] <= hi[2]; ijk[2] += LeafT::DIM) {
+                    touchLeaf(ijk);
+                }
+            }
+        }
+    }
+
+    tree::LeafManager<TreeT> leafs(*coarse);
+    leafs.foreach([&fine](LeafT& leaf, size_t) { restrictLeaf<OpT>(fine, leaf); });
+
+    // Filling a leaf-aligned box inserts tiles without allocating any leaves.
+    for (const auto& tile: tiles) {
+        coarse->fill(tile.first, tile.second, /*active=*/true);
+    }
+
+    if (isLevelSet) {
+        rebuildLevelSet(*coarse, std::is_floating_point<typename TreeT::ValueType>());
+    }
+    return coarse;
+}
+
+
+/// @brief Return a new tree at half the resolution of @a fine,
+/// reduced with the given (non-linear) kernel.
+template<typename TreeT>
+inline typename TreeT::Ptr
+restrictTree(const TreeT& fine, Filter filter, bool isLevelSet, bool usePool,
+    openvdb::Index64& tileLeafCount)
+{
+    switch (filter) {
+        case Filter::Box: return restrictWith<BoxReduce>(fine, isLevelSet, usePool, tileLeafCount);
+        case Filter::Min: return restrictWith<MinReduce>(fine, isLevelSet, usePool, tileLeafCount);
+        case Filter::Max: return restrictWith<MaxReduce>(fine, isLevelSet, usePool, tileLeafCount);
+        case Filter::Sdf: return restrictWith<SdfReduce>(fine, isLevelSet, usePool, tileLeafCount);
+        case Filter::Linear: break;
+    }
+    return typename TreeT::Ptr();
+}
+
+
+/// @brief Return the name of mip level @a level of the grid named @a name.
+inline std::string
+levelName(const std::string& name, double level)
+{
+    std::ostringstream ostr;
+    ostr << name << "_level_" << level;
+    return ostr.str();
+}
+
+
+/// @brief Record in the metadata of @a grid that it is mip level @a level
+/// (counted from the input grid, whatever level the mipmap was built from).
+/// @details MultiResGrid numbers its own levels from its base level, and the input
+/// grid may itself carry the level metadata of an earlier run, so any existing
+/// fields are replaced.
+inline void
+setLevelMetadata(openvdb::GridBase& grid, double level)
+{
+    for (const char* name: { sLevelMetaName, "MultiResGrid_Level" }) {
+        grid.removeMeta(name);
+        grid.insertMeta(name, openvdb::FloatMetadata(float(level)));
+    }
+}
+
+
+/// @brief Generate the requested integer mip levels of a grid by repeated
+/// reduction with the kernel selected in @a opts.
+/// @details Only two consecutive levels are resident at a time, apart from
+/// those that are output.  The input grid's tree is released (and replaced
+/// with an empty tree) as soon as level 1 has been built from it.
+template<typename GridType>
+inline openvdb::GridPtrVec
+reduceLevels(const typename GridType::Ptr& inGrid, const Options& opts)
+{
+    using namespace openvdb;
+    using TreeT = typename GridType::TreeType;
+
+    const bool isLevelSet = (inGrid->getGridClass() == GRID_LEVEL_SET);
+
+    std::set<size_t> requested;
+    for (double level = opts.from; level <= opts.to; level += opts.step) {
+        requested.insert(static_cast<size_t>(level + 0.5));
+    }
+    const size_t last = *requested.rbegin();
+
+    // Each coarser voxel covers a 2×2×2 block of finer voxels,
+    // so its center lies half a fine voxel from the block's origin.
+    typename TreeT::Ptr tree = inGrid->treePtr();
+    math::Transform::Ptr xform = inGrid->transform().copy();
+
+    GridPtrVec outGrids;
+    for (size_t n = 0; n <= last; ++n) {
+        double levelSecs = 0.0;
+        if (n > 0) {
+            util::CpuTimer timer;
+            timer.start();
+            Index64 tileLeafCount = 0;
+            typename TreeT::Ptr coarse =
+                restrictTree(*tree, opts.filter, isLevelSet, opts.pool, tileLeafCount);
+            if (n == 1) {
+                inGrid->newTree();
+            } else if (opts.pool && tree.use_count() == 1) {
+                // This level is not output, so its leaves can be reused.
+                LeafPool<typename TreeT::LeafNodeType>::instance().recycle(*tree);
+            }
+            tree = coarse;
+            xform = xform->copy();
+            xform->preTranslate(Vec3d(0.5));
+            xform->preScale(2.0);
+            const double secs = timer.seconds();
+            if (opts.timings) opts.timings->restrictSecs += secs;
+            levelSecs = secs;
+            const Index64 leafCount = tree->leafCount();
+            OPENVDB_LOG_INFO("generated level " << n << " of \"" << inGrid->getName()
+                << "\" in " << std::setprecision(3) << secs << " sec ("
+                << leafCount << " leaf nodes, " << (leafCount + tileLeafCount)
+                << " if tiles were densified)");
+        }
+        if (requested.count(n)) {
+            util::CpuTimer timer;
+            timer.start();
+            typename GridType::Ptr grid = GridType::create(tree);
+            grid->insertMeta(*inGrid);
+            grid->setTransform(xform);
+            grid->setName(levelName(inGrid->getName(), double(n)));
+            setLevelMetadata(*grid, double(n));
+            outGrids.push_back(grid);
+            if (opts.timings) {
+                const double secs = timer.seconds();
+                opts.timings->createSecs += secs;
+                opts.timings->levels.push_back(
+                    Timings::Level{double(n), tree->activeVoxelCount(), levelSecs + secs});
+            }
+        }
+    }
+    return outGrids;
+}
+
+
+////////////////////////////////////////
+
+
+/// @brief Return a hash of @a key that is uniformly distributed
+/// over the 64-bit integers (the splitmix64 finalizer).
+inline uint64_t
+hashKey(uint64_t key)
+{
+    key += 0x9e3779b97f4a7c15ULL;
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    return key ^ (key >> 31);
+}
+
+
+/// @brief Delete from @a tree all but a stable, pseudorandom @a fraction of the
+/// points of the original input, of which @a tree holds the fraction @a kept.
+/// @details Each point is kept if the hash of its "id" attribute falls below
+/// @a fraction of the hash range, so decimating at a smaller fraction always
+/// keeps a subset of the points that a larger fraction keeps.  Without an "id",
+/// points are instead hashed by their leaf origin and index, which change as
+/// points are deleted, so the points that @a tree holds are decimated by
+/// the relative fraction @a fraction / @a kept.
+inline void
+decimatePoints(openvdb::points::PointDataTree& tree, double fraction, double kept = 1.0)
+{
+    using namespace openvdb;
+    using LeafT = points::PointDataTree::LeafNodeType;
+
+    if (!tree.cbeginLeaf()) return;
+
+    if (fraction >= kept) return;
+    const uint64_t threshold = static_cast<uint64_t>(std::ldexp(fraction, 64));
+    const uint64_t relativeThreshold = static_cast<uint64_t>(std::ldexp(fraction / kept, 64));
+    const Name keepGroup = "__lod_keep";
+
+    points::appendGroup(tree, keepGroup);
+
+    tree::LeafManager<points::PointDataTree> leafs(tree);
+    leafs.foreach([&](LeafT& leaf, size_t) {
+        std::unique_ptr<points::AttributeHandle<int64_t>> id64;
+        std::unique_ptr<points::AttributeHandle<int32_t>> id32;
+        const size_t idPos = leaf.attributeSet().find("id");
+        if (idPos != points::AttributeSet::INVALID_POS) {
+            const points::AttributeArray& ids = leaf.constAttributeArray(idPos);
+            if (ids.hasValueType<int64_t>()) {
+                id64.reset(new points::AttributeHandle<int64_t>(ids));
+            } else if (ids.hasValueType<int32_t>()) {
+                id32.reset(new points::AttributeHandle<int32_t>(ids));
+            }
+        }
+
+        const Coord& origin = leaf.origin();
+        const uint64_t leafKey = hashKey(hashKey(
+            uint64_t(uint32_t(origin.x())) | (uint64_t(uint32_t(origin.y())) << 32))
+            ^ uint64_t(uint32_t(origin.z())));
+
+        points::GroupWriteHandle keep = leaf.groupWriteHandle(keepGroup);
+        for (Index n = 0, N = Index(leaf.pointCount()); n < N; ++n) {
+            bool keepPoint;
+            if (id64) keepPoint = hashKey(uint64_t(id64->get(n))) < threshold;
+            else if (id32) keepPoint = hashKey(uint64_t(int64_t(id32->get(n)))) < threshold;
+            else keepPoint = hashKey(leafKey ^ n) < relativeThreshold;
+            if (keepPoint) keep.set(n, true);
+        }
+        keep.compact();
+    });
+
+    points::deleteFromGroup(tree, keepGroup, /*invert=*/true, /*drop=*/false);
+    points::dropGroup(tree, keepGroup);
+}
+
+
+/// @brief Generate a level of detail of a point data grid for each requested
+/// mip level, by decimating the points by a factor of eight per level.
+/// @return a vector of pointers to the decimated grids
+/// @note To bound memory usage, the input grid itself becomes the finest level,
+/// and so is renamed and, if that level is coarser than level 0, decimated.
+inline openvdb::GridPtrVec
+decimate(const openvdb::points::PointDataGrid::Ptr& inGrid, const Options& opts)
+{
+    using namespace openvdb;
+
+    const std::string name = inGrid->getName();
+
+    OPENVDB_LOG_INFO("processing point grid \"" << name << "\"");
+
+    util::CpuTimer timer;
+    timer.start();
+
+    // Each level is decimated from the previous (and therefore smaller) one,
+    // and the finest level from the input grid, which is not otherwise output.
+    GridPtrVec outGrids;
+    points::PointDataGrid::Ptr finer;
+    double kept = 1.0; // fraction of the input's points held by the finer level
+    for (double level = opts.from; level <= opts.to; level += opts.step) {
+        points::PointDataGrid::Ptr grid = finer ? finer->deepCopy() : inGrid;
+        const double fraction = std::pow(0.125, level);
+        if (level > 0.0) decimatePoints(grid->tree(), fraction, kept);
+        kept = std::min(kept, fraction);
+        grid->setName(levelName(name, level));
+        setLevelMetadata(*grid, level);
+
+        OPENVDB_LOG_DEBUG_RUNTIME("level " << level << " of \"" << name
+            << "\" has " << points::pointCount(grid->constTree()) << " points");
+
+        outGrids.push_back(grid);
+        finer = grid;
+    }
+
+    if (outGrids.size() == 1 && opts.preserve) {
+        outGrids[0]->setName(name);
+    }
+
+    OPENVDB_LOG_INFO("processed point grid \"" << name << "\" in "
+        << std::setprecision(3) << timer.seconds() << " sec");
+
+    return outGrids;
+}
+
+
+////////////////////////////////////////
+
+
 /// @brief Mipmap a single grid of a fully-resolved type.
 /// @return a vector of pointers to the member grids of the mipmap
+/// @note To bound memory usage, the input grid's tree is stolen
+/// and the grid is left empty.
 template<typename GridType>
 inline openvdb::GridPtrVec
-mip(const GridType& inGrid, const Options& opts)
+mip(const typename GridType::Ptr& inGrid, const Options& opts)
 {
-    OPENVDB_LOG_INFO("processing grid \"" << inGrid.getName() << "\"");
+    const std::string name = inGrid->getName();
 
-    // MultiResGrid requires at least two mipmap levels, starting from level 0.
-    const int levels = std::max(2, openvdb::math::Ceil(opts.to) + 1);
+    OPENVDB_LOG_INFO("processing grid \"" << name << "\"");
 
     openvdb::util::CpuTimer timer;
     timer.start();
 
-    // Initialize the mipmap.
-    typedef typename GridType::TreeType TreeT;
-    openvdb::tools::MultiResGrid<TreeT> mrg(levels, inGrid);
-
     openvdb::GridPtrVec outGrids;
-    for (double level = opts.from; level <= opts.to; level += opts.step) {
-        // Request a level from the mipmap.
-        if (openvdb::GridBase::Ptr levelGrid =
-            mrg.template createGrid</*sampling order=*/1>(static_cast<float>(level)))
-        {
-            outGrids.push_back(levelGrid);
+    if (opts.filter != Filter::Linear) {
+        outGrids = reduceLevels<GridType>(inGrid, opts);
+    } else {
+        typedef typename GridType::TreeType TreeT;
+
+        // If the finest requested level is coarser than level 0, build the integer
+        // levels below it one at a time, each from the previous one.  A two-level
+        // MultiResGrid takes ownership of the finer tree, so it is released as soon
+        // as the next level has been extracted, and level 0 is never copied.
+        openvdb::util::CpuTimer restrictTimer;
+        restrictTimer.start();
+
+        const int first = static_cast<int>(std::floor(opts.from));
+        typename GridType::Ptr base = inGrid;
+        for (int n = 0; n < first; ++n) {
+            openvdb::tools::MultiResGrid<TreeT> step(2, base);
+            base = step.grid(1);
+        }
+
+        // MultiResGrid requires at least two mipmap levels, starting from level 0.
+        const int levels = std::max(2, openvdb::math::Ceil(opts.to) - first + 1);
+
+        // Initialize the mipmap, which takes ownership of the base level's tree.
+        const openvdb::tools::MultiResGrid<TreeT> mrg(levels, base);
+        base.reset();
+
+        if (opts.timings) opts.timings->restrictSecs += restrictTimer.seconds();
+
+        std::vector<double> requested;
+        for (double level = opts.from; level <= opts.to; level += opts.step) {
+            requested.push_back(level);
+        }
+
+        // Request the levels from the mipmap concurrently.  Each (fractional) level
+        // is interpolated independently from the read-only integer levels.
+        std::vector<openvdb::GridBase::Ptr> levelGrids(requested.size());
+        std::vector<double> levelSecs(requested.size(), 0.0);
+        openvdb::util::CpuTimer createTimer;
+        createTimer.start();
+        tbb::parallel_for(size_t(0), requested.size(), [&](size_t i) {
+            openvdb::util::CpuTimer levelTimer;
+            levelTimer.start();
+            levelGrids[i] = mrg.template createGrid</*sampling order=*/1>(
+                static_cast<float>(requested[i] - first));
+            levelSecs[i] = levelTimer.seconds();
+        });
+        if (opts.timings) opts.timings->createSecs += createTimer.seconds();
+
+        for (size_t i = 0; i < requested.size(); ++i) {
+            if (openvdb::GridBase::Ptr levelGrid = levelGrids[i]) {
+                levelGrid->setName(levelName(name, requested[i]));
+                setLevelMetadata(*levelGrid, requested[i]);
+                outGrids.push_back(levelGrid);
+                if (opts.timings) {
+                    opts.timings->levels.push_back(Timings::Level{
+                        requested[i], levelGrid->activeVoxelCount(), levelSecs[i]});
+                }
+                OPENVDB_LOG_INFO("generated level " << requested[i] << " of \"" << name
+                    << "\" in " << std::setprecision(3) << levelSecs[i] << " sec");
+            }
         }
     }
 
     if (outGrids.size() == 1 && opts.preserve) {
         // If -preserve is in effect and there is only one output grid,
         // give it the same name as the input grid.
-        outGrids[0]->setName(inGrid.getName());
+        outGrids[0]->setName(name);
     }
 
-    OPENVDB_LOG_INFO("processed grid \"" << inGrid.getName() << "\" in "
+    OPENVDB_LOG_INFO("processed grid \"" << name << "\" in "
         << std::setprecision(3) << timer.seconds() << " sec");
 
     return outGrids;
@@ -156,6 +1010,7 @@ mip(const GridType& inGrid, const Options& opts)
 
 
 /// @brief Mipmap a single grid and append the resulting grids to @a outGrids.
+/// @note The tree of a grid that is mipmapped might be released.
 inline void
 process(const openvdb::GridBase::Ptr& baseGrid, openvdb::GridPtrVec& outGrids, const Options& opts)
 {
@@ -164,13 +1019,16 @@ process(const openvdb::GridBase::Ptr& baseGrid, openvdb::GridPtrVec& outGrids, c
     if (!baseGrid) return;
 
     GridPtrVec mipmap;
-    if (FloatGrid::Ptr g0 = GridBase::grid<FloatGrid>(baseGrid)) { mipmap = mip(*g0, opts); }
-    else if (DoubleGrid::Ptr g1 = GridBase::grid<DoubleGrid>(baseGrid)) { mipmap = mip(*g1, opts); }
-    else if (Vec3SGrid::Ptr  g2 = GridBase::grid<Vec3SGrid>(baseGrid))  { mipmap = mip(*g2, opts); }
-    else if (Vec3DGrid::Ptr  g3 = GridBase::grid<Vec3DGrid>(baseGrid))  { mipmap = mip(*g3, opts); }
-    else if (Vec3IGrid::Ptr  g4 = GridBase::grid<Vec3IGrid>(baseGrid))  { mipmap = mip(*g4, opts); }
-    else if (Int32Grid::Ptr  g5 = GridBase::grid<Int32Grid>(baseGrid))  { mipmap = mip(*g5, opts); }
-    else if (Int64Grid::Ptr  g6 = GridBase::grid<Int64Grid>(baseGrid))  { mipmap = mip(*g6, opts); }
+    if (FloatGrid::Ptr g0 = GridBase::grid<FloatGrid>(baseGrid)) { mipmap = mip<FloatGrid>(g0, opts); }
+    else if (DoubleGrid::Ptr g1 = GridBase::grid<DoubleGrid>(baseGrid)) { mipmap = mip<DoubleGrid>(g1, opts); }
+    else if (Vec3SGrid::Ptr  g2 = GridBase::grid<Vec3SGrid>(baseGrid))  { mipmap = mip<Vec3SGrid>(g2, opts); }
+    else if (Vec3DGrid::Ptr  g3 = GridBase::grid<Vec3DGrid>(baseGrid))  { mipmap = mip<Vec3DGrid>(g3, opts); }
+    else if (Vec3IGrid::Ptr  g4 = GridBase::grid<Vec3IGrid>(baseGrid))  { mipmap = mip<Vec3IGrid>(g4, opts); }
+    else if (Int32Grid::Ptr  g5 = GridBase::grid<Int32Grid>(baseGrid))  { mipmap = mip<Int32Grid>(g5, opts); }
+    else if (Int64Grid::Ptr  g6 = GridBase::grid<Int64Grid>(baseGrid))  { mipmap = mip<Int64Grid>(g6, opts); }
+    else if (points::PointDataGrid::Ptr g7 = GridBase::grid<points::PointDataGrid>(baseGrid)) {
+        mipmap = decimate(g7, opts);
+    }
     else {
         std::string operation = "skipped";
         if (opts.keep) {
@@ -183,6 +1041,401 @@ process(const openvdb::GridBase::Ptr& baseGrid, openvdb::GridPtrVec& outGrids, c
     outGrids.insert(outGrids.end(), mipmap.begin(), mipmap.end());
 }
 
+
+////////////////////////////////////////
+
+
+/// @brief Return the size in bytes of the named file.
+inline uint64_t
+fileSize(const std::string& filename)
+{
+    std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary | std::ios::ate);
+    return file ? static_cast<uint64_t>(file.tellg()) : 0;
+}
+
+
+/// @brief Return the given path without its leading directories.
+inline std::string
+baseName(const std::string& path)
+{
+    const size_t slash = path.rfind('/');
+    return (slash == std::string::npos ? path : path.substr(slash + 1));
+}
+
+
+/// @brief Return the given string quoted and escaped for use in JSON.
+inline std::string
+jsonString(const std::string& str)
+{
+    std::ostringstream ostr;
+    ostr << '"';
+    for (const char c: str) {
+        switch (c) {
+            case '"': ostr << "\\\""; break;
+            case '\\': ostr << "\\\\"; break;
+            case '\n': ostr << "\\n"; break;
+            case '\t': ostr << "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    ostr << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+                        << int(c) << std::dec << std::setfill(' ');
+                } else {
+                    ostr << c;
+                }
+        }
+    }
+    ostr << '"';
+    return ostr.str();
+}
+
+
+/// One output file of a sharded mipmap
+struct Shard
+{
+    double level; ///< mip level, or a negative value for grids that are not mip levels
+    std::string filename;
+    openvdb::GridPtrVec grids;
+    uint32_t compression;
+    uint64_t bytes;
+    double seconds;
+};
+
+
+/// @brief Write a JSON description of the given shard's grids to @a os.
+inline void
+writeShardManifest(std::ostream& os, const Shard& shard, const char* indent)
+{
+    os << indent << "\"file\": " << jsonString(baseName(shard.filename)) << ",\n"
+       << indent << "\"bytes\": " << shard.bytes << ",\n"
+       << indent << "\"grids\": [";
+    for (size_t i = 0; i < shard.grids.size(); ++i) {
+        const openvdb::GridBase& grid = *shard.grids[i];
+        const openvdb::Vec3d voxelSize = grid.voxelSize();
+        os << (i == 0 ? "\n" : ",\n") << indent << "    {\n"
+           << indent << "        \"name\": " << jsonString(grid.getName()) << ",\n"
+           << indent << "        \"type\": " << jsonString(grid.type()) << ",\n"
+           << indent << "        \"voxelSize\": ["
+           << voxelSize[0] << ", " << voxelSize[1] << ", " << voxelSize[2] << "],\n"
+           << indent << "        \"bbox\": ";
+        const openvdb::CoordBBox bbox = grid.evalActiveVoxelBoundingBox();
+        if (bbox.empty()) {
+            os << "null";
+        } else {
+            // World-space bounds of the active voxels
+            const openvdb::BBoxd wbox = grid.transform().indexToWorld(bbox);
+            os << "[[" << wbox.min()[0] << ", " << wbox.min()[1] << ", " << wbox.min()[2]
+               << "], [" << wbox.max()[0] << ", " << wbox.max()[1] << ", " << wbox.max()[2]
+               << "]]";
+        }
+        os << "\n" << indent << "    }";
+    }
+    os << "\n" << indent << "]";
+}
+
+
+/// @brief Return the mip level recorded in the metadata of the given grid,
+/// or a negative value if the grid is not a mip level.
+inline double
+gridLevel(const openvdb::GridBase& grid)
+{
+    if (openvdb::FloatMetadata::ConstPtr level =
+        grid.getMetadata<openvdb::FloatMetadata>(sLevelMetaName))
+    {
+        return level->value();
+    }
+    return -1.0;
+}
+
+
+/// @brief Set the floating-point precision with which each mip level
+/// is to be saved, according to the storage policies in @a opts.
+inline void
+applyStorage(const openvdb::GridPtrVec& grids, const Options& opts)
+{
+    for (const openvdb::GridBase::Ptr& grid: grids) {
+        const double level = gridLevel(*grid);
+        if (level >= 0.0) grid->setSaveFloatAsHalf(opts.storage(level).half);
+    }
+}
+
+
+/// @brief Write the grids of each mip level to a separate file, concurrently,
+/// together with a JSON manifest that lists the files coarsest level first.
+/// @details Grids that are not mip levels (i.e., that were passed through)
+/// are written to @a outFilename itself.
+inline void
+writeShards(const openvdb::GridPtrVec& grids, const openvdb::MetaMap& fileMetadata,
+    const std::string& outFilename, const Options& opts)
+{
+    using namespace openvdb;
+
+    // Split "path/out.vdb" into "path/out" and ".vdb".
+    std::string stem = outFilename, ext = ".vdb";
+    const size_t dot = outFilename.rfind('.'), slash = outFilename.rfind('/');
+    if (dot != std::string::npos && (slash == std::string::npos || dot > slash)) {
+        stem = outFilename.substr(0, dot);
+        ext = outFilename.substr(dot);
+    }
+
+    // Group the grids by mip level, coarsest level first.
+    std::map<double, GridPtrVec, std::greater<double>> levels;
+    GridPtrVec others;
+    for (const GridBase::Ptr& grid: grids) {
+        const double level = gridLevel(*grid);
+        if (level >= 0.0) {
+            levels[level].push_back(grid);
+        } else {
+            others.push_back(grid);
+        }
+    }
+    std::vector<Shard> shards;
+    for (const auto& level: levels) {
+        shards.push_back(Shard{level.first, levelName(stem, level.first) + ext,
+            level.second, opts.storage(level.first).compression, 0, 0.0});
+    }
+    if (!others.empty()) {
+        shards.push_back(Shard{-1.0, outFilename, others,
+            opts.defaultStorage.compression, 0, 0.0});
+    }
+
+    tbb::parallel_for(size_t(0), shards.size(), [&](size_t i) {
+        Shard& shard = shards[i];
+        util::CpuTimer timer;
+        timer.start();
+        io::File file(shard.filename);
+        file.setCompression(shard.compression);
+        file.write(shard.grids, fileMetadata);
+        shard.seconds = timer.seconds();
+        shard.bytes = fileSize(shard.filename);
+    });
+
+    for (const Shard& shard: shards) {
+        std::ostringstream ostr;
+        if (shard.level >= 0.0) ostr << "level " << shard.level << " ";
+        OPENVDB_LOG_INFO("wrote " << ostr.str() << "file " << shard.filename
+            << " (" << io::compressionToString(shard.compression) << ", "
+            << shard.bytes << " bytes) in "
+            << std::setprecision(3) << shard.seconds << " sec");
+    }
+
+    const std::string manifestFilename = stem + "_manifest.json";
+    std::ofstream manifest(manifestFilename.c_str());
+    manifest << std::setprecision(9) << "{\n    \"levels\": [";
+    bool first = true;
+    for (const Shard& shard: shards) {
+        if (shard.level < 0.0) continue;
+        manifest << (first ? "\n" : ",\n") << "        {\n"
+            << "            \"level\": " << shard.level << ",\n";
+        writeShardManifest(manifest, shard, "            ");
+        manifest << "\n        }";
+        first = false;
+    }
+    manifest << "\n    ]";
+    if (!shards.empty() && shards.back().level < 0.0) {
+        manifest << ",\n    \"passthrough\": {\n";
+        writeShardManifest(manifest, shards.back(), "        ");
+        manifest << "\n    }";
+    }
+    manifest << "\n}\n";
+    if (!manifest) {
+        OPENVDB_THROW(IoError, "failed to write manifest " << manifestFilename);
+    }
+    OPENVDB_LOG_INFO("wrote manifest " << manifestFilename);
+}
+
+
+////////////////////////////////////////
+
+
+/// @brief Return the peak resident set size of this process in bytes,
+/// or zero if it is not available.
+inline uint64_t
+peakRssBytes()
+{
+#ifdef _WIN32
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#if defined(__APPLE__)
+    return static_cast<uint64_t>(usage.ru_maxrss); // in bytes
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024; // in kilobytes
+#endif
+#endif
+}
+
+
+/// @brief Return a pseudorandom value in [0, 1) that depends only on @a ijk and @a seed.
+inline float
+hashUnit(const openvdb::Coord& ijk, uint64_t seed)
+{
+    const uint64_t key = hashKey(hashKey(hashKey(seed ^ uint64_t(uint32_t(ijk.x())))
+        ^ uint64_t(uint32_t(ijk.y()))) ^ uint64_t(uint32_t(ijk.z())));
+    return float(key >> 40) / float(1 << 24);
+}
+
+
+/// @brief Return the @a n-th synthetic grid on which -benchmark is run,
+/// or a null pointer if there are fewer than @a n + 1 grids.
+/// @details The grids are generated deterministically, so that results
+/// are comparable across runs, library versions and machines.
+inline openvdb::GridBase::Ptr
+makeBenchmarkGrid(size_t n)
+{
+    using namespace openvdb;
+
+    switch (n) {
+        case 0: case 1: case 2:
+        {
+            // Narrow-band level sets, whose voxel counts grow with the square of the radius
+            const float radius = float(64 << n);
+            FloatGrid::Ptr sphere = tools::createLevelSetSphere<FloatGrid>(
+                radius, Vec3f(0.0f), /*voxelSize=*/1.0f, /*halfWidth=*/3.0f);
+            sphere->setName("sphere_r" + std::to_string(64 << n));
+            return sphere;
+        }
+        case 3:
+        {
+            // A fog volume filled with white noise, which has no uniform regions
+            FloatGrid::Ptr fog = FloatGrid::create(0.0f);
+            fog->denseFill(CoordBBox(Coord(0), Coord(255)), 0.0f, /*active=*/true);
+            tree::LeafManager<FloatTree> leafs(fog->tree());
+            leafs.foreach([](FloatTree::LeafNodeType& leaf, size_t) {
+                for (auto iter = leaf.beginValueOn(); iter; ++iter) {
+                    iter.setValue(hashUnit(iter.getCoord(), 1));
+                }
+            });
+            fog->setGridClass(GRID_FOG_VOLUME);
+            fog->setName("fog_noise");
+            return fog;
+        }
+        case 4:
+        {
+            // Isolated vectors scattered through a 2048³ domain
+            Vec3SGrid::Ptr field = Vec3SGrid::create(Vec3s(0.0f));
+            Vec3SGrid::Accessor acc = field->getAccessor();
+            for (uint64_t i = 0; i < 200000; ++i) {
+                const uint64_t key = hashKey(i);
+                const Coord ijk(Int32(key & 0x7ff), Int32((key >> 11) & 0x7ff),
+                    Int32((key >> 22) & 0x7ff));
+                acc.setValueOn(ijk, Vec3s(hashUnit(ijk, 2), hashUnit(ijk, 3),
+                    hashUnit(ijk, 4)) - Vec3s(0.5f));
+            }
+            field->setName("vec3_sparse");
+            return field;
+        }
+        default: break;
+    }
+    return GridBase::Ptr();
+}
+
+
+/// @brief Mipmap each of the synthetic grids in turn and write a JSON report
+/// of the time spent in each phase and the throughput of each level to @a os.
+/// @details Each grid is serialized to memory with the default compression in
+/// @a baseOpts and read back, so that reading can be timed without any files.
+/// The mip levels are likewise written to memory.
+inline void
+runBenchmark(const Options& baseOpts, std::ostream& os)
+{
+    using namespace openvdb;
+
+    os << std::setprecision(6) << "{\n"
+       << "    \"library\": " << jsonString(getLibraryAbiVersionString()) << ",\n"
+       << "    \"filter\": " << jsonString(filterName(baseOpts.filter)) << ",\n"
+       << "    \"range\": [" << baseOpts.from << ", " << baseOpts.to << ", "
+       << baseOpts.step << "],\n"
+       << "    \"compression\": " << jsonString(
+           io::compressionToString(baseOpts.defaultStorage.compression)) << ",\n"
+       << "    \"datasets\": [";
+
+    for (size_t n = 0; ; ++n) {
+        std::string name, type, input;
+        Index64 voxels = 0;
+        {
+            GridBase::Ptr grid = makeBenchmarkGrid(n);
+            if (!grid) break;
+            name = grid->getName();
+            type = grid->type();
+            voxels = grid->activeVoxelCount();
+
+            std::ostringstream ostr(std::ios_base::binary);
+            io::Stream stream(ostr);
+            stream.setCompression(baseOpts.defaultStorage.compression);
+            stream.write(GridCPtrVec(1, grid));
+            input = ostr.str();
+        }
+        OPENVDB_LOG_INFO("benchmarking grid \"" << name << "\" (" << voxels << " voxels)");
+
+        util::CpuTimer timer;
+        timer.start();
+        GridPtrVecPtr inGrids;
+        {
+            std::istringstream istr(input, std::ios_base::binary);
+            inGrids = io::Stream(istr, /*delayLoad=*/false).getGrids();
+        }
+        const double readSecs = timer.seconds();
+        input.clear();
+        input.shrink_to_fit();
+
+        Timings timings;
+        Options opts = baseOpts;
+        opts.timings = &timings;
+        GridPtrVec outGrids;
+        for (const GridBase::Ptr& grid: *inGrids) process(grid, outGrids, opts);
+        inGrids.reset();
+        applyStorage(outGrids, opts);
+
+        timer.start();
+        std::ostringstream ostr(std::ios_base::binary);
+        {
+            io::Stream stream(ostr);
+            stream.setCompression(opts.defaultStorage.compression);
+            stream.write(outGrids);
+        }
+        const double writeSecs = timer.seconds();
+        const uint64_t bytes = static_cast<uint64_t>(ostr.tellp());
+
+        outGrids.clear();
+        if (opts.pool) releaseLeafPools();
+
+        os << (n == 0 ? "\n" : ",\n") << "        {\n"
+           << "            \"name\": " << jsonString(name) << ",\n"
+           << "            \"type\": " << jsonString(type) << ",\n"
+           << "            \"voxels\": " << voxels << ",\n"
+           << "            \"seconds\": {\n"
+           << "                \"read\": " << readSecs << ",\n"
+           << "                \"restriction\": " << timings.restrictSecs << ",\n"
+           << "                \"createGrid\": " << timings.createSecs << ",\n"
+           << "                \"write\": " << writeSecs << "\n"
+           << "            },\n"
+           << "            \"levels\": [";
+        for (size_t i = 0; i < timings.levels.size(); ++i) {
+            const Timings::Level& level = timings.levels[i];
+            os << (i == 0 ? "\n" : ",\n") << "                {"
+               << "\"level\": " << level.level
+               << ", \"voxels\": " << level.voxels
+               << ", \"seconds\": " << level.seconds
+               << ", \"voxelsPerSecond\": ";
+            if (level.seconds > 0.0) {
+                os << double(level.voxels) / level.seconds;
+            } else {
+                os << "null";
+            }
+            os << "}";
+        }
+        os << "\n            ],\n"
+           << "            \"outputBytes\": " << bytes << ",\n"
+           // The peak is that of the process so far, so it never decreases.
+           << "            \"peakRssBytes\": " << peakRssBytes() << "\n"
+           << "        }";
+    }
+    os << "\n    ],\n"
+       << "    \"peakRssBytes\": " << peakRssBytes() << "\n"
+       << "}" << std::endl;
+}
+
 } // unnamed namespace
 
 
@@ -203,8 +1456,8 @@ main(int argc, char *argv[])
 
     // Parse command-line arguments.
     Options opts;
-    bool version = false;
-    std::string inFilename, outFilename, gridNameStr, rangeSpec;
+    bool version = false, benchmark = false;
+    std::string inFilename, outFilename, gridNameStr, rangeSpec, filterName, storageSpec;
     for (int i = 1; i < argc; ++i) {
         const std::string arg = argv[i];
         if (arg[0] == '-') {
@@ -224,6 +1477,30 @@ main(int argc, char *argv[])
                 opts.preserve = true;
             } else if (arg == "-nopreserve") {
                 opts.preserve = false;
+            } else if (arg == "-pool") {
+                opts.pool = true;
+            } else if (arg == "-nopool") {
+                opts.pool = false;
+            } else if (arg == "-shard") {
+                opts.shard = true;
+            } else if (arg == "-noshard") {
+                opts.shard = false;
+            } else if (arg == "-compress") {
+                if (i + 1 < argc && argv[i + 1]) {
+                    storageSpec = argv[i + 1];
+                    ++i;
+                } else {
+                    OPENVDB_LOG_FATAL("missing storage specification after -compress");
+                    usage();
+                }
+            } else if (arg == "-filter") {
+                if (i + 1 < argc && argv[i + 1]) {
+                    filterName = argv[i + 1];
+                    ++i;
+                } else {
+                    OPENVDB_LOG_FATAL("missing kernel name after -filter");
+                    usage();
+                }
             } else if (arg == "-range") {
                 if (i + 1 < argc && argv[i + 1]) {
                     rangeSpec = argv[i + 1];
@@ -232,6 +1509,8 @@ main(int argc, char *argv[])
                     OPENVDB_LOG_FATAL("missing level range specification after -range");
                     usage();
                 }
+            } else if (arg == "-benchmark") {
+                benchmark = true;
             } else if (arg == "-h" || arg == "-help" || arg == "--help") {
                 usage(EXIT_SUCCESS);
             } else if (arg == "-version" || arg == "--version") {
@@ -257,14 +1536,20 @@ main(int argc, char *argv[])
             << openvdb::getLibraryAbiVersionString() << "\n";
         std::cout << "OpenVDB file format version: "
             << openvdb::OPENVDB_FILE_VERSION << std::endl;
-        if (outFilename.empty()) return EXIT_SUCCESS;
+        if (outFilename.empty() && !benchmark) return EXIT_SUCCESS;
     }
 
-    if (inFilename.empty()) {
+    if (benchmark) {
+        if (!inFilename.empty()) {
+            OPENVDB_LOG_WARN("ignoring input and output files with -benchmark");
+        }
+        if (rangeSpec.empty()) rangeSpec = "0-4";
+    }
+    if (inFilename.empty() && !benchmark) {
         OPENVDB_LOG_FATAL("missing input OpenVDB filename");
         usage();
     }
-    if (outFilename.empty()) {
+    if (outFilename.empty() && !benchmark) {
         OPENVDB_LOG_FATAL("missing output OpenVDB filename");
         usage();
     }
@@ -280,6 +1565,49 @@ main(int argc, char *argv[])
         usage();
     }
 
+    if (!storageSpec.empty()) {
+        try {
+            parseStorageSpec(storageSpec, opts);
+        } catch (const std::exception& e) {
+            OPENVDB_LOG_FATAL("invalid storage specification \"" << storageSpec << "\""
+                << (e.what()[0] != '\0' ? std::string(": ") + e.what() : std::string()));
+            usage();
+        }
+        if (!opts.shard && !opts.levelStorage.empty()) {
+            OPENVDB_LOG_WARN("without -shard, all levels are written with the"
+                " compression specified for \"*\"");
+        }
+    }
+
+    const bool integerLevels =
+        (opts.from == std::floor(opts.from) && opts.step == std::floor(opts.step));
+    if (!filterName.empty()) {
+        try {
+            opts.filter = parseFilter(filterName);
+        } catch (...) {
+            OPENVDB_LOG_FATAL("invalid kernel name \"" << filterName << "\"");
+            usage();
+        }
+    }
+    if (opts.filter != Filter::Linear && !integerLevels) {
+        OPENVDB_LOG_FATAL("-filter " << filterName << " supports only integer mip levels");
+        usage();
+    }
+    if (opts.pool && opts.filter == Filter::Linear) {
+        OPENVDB_LOG_FATAL("-pool is not supported with -filter linear");
+        usage();
+    }
+
+    if (benchmark) {
+        try {
+            runBenchmark(opts, std::cout);
+        } catch (const std::exception& e) {
+            OPENVDB_LOG_FATAL(e.what());
+            exitStatus = EXIT_FAILURE;
+        }
+        return exitStatus;
+    }
+
     // If -name was specified, generate a accept list of names of grids to be processed.
     // Otherwise (if the accept list is empty), process all grids of supported types.
     std::set<std::string> acceptlist;
@@ -323,10 +1651,32 @@ main(int argc, char *argv[])
         }
         file.close();
 
+        if (sLeafCounts.allocated > 0) {
+            OPENVDB_LOG_INFO("mip level leaf nodes: " << sLeafCounts.allocated << " allocated, "
+                << sLeafCounts.reused << " reused, " << sLeafCounts.recycled << " recycled");
+        }
+
+        applyStorage(outGrids, opts);
+
+        if (opts.pool) {
+            openvdb::util::CpuTimer timer;
+            timer.start();
+            releaseLeafPools();
+            OPENVDB_LOG_INFO("released leaf pools in "
+                << std::setprecision(3) << timer.seconds() << " sec");
+        }
+
+        if (opts.shard) {
+            writeShards(outGrids, fileMetadata ? *fileMetadata : openvdb::MetaMap(),
+                outFilename, opts);
+            return exitStatus;
+        }
+
         openvdb::util::CpuTimer timer;
         timer.start();
 
         openvdb::io::File outFile(outFilename);
+        outFile.setCompression(opts.defaultStorage.compression);
         if (fileMetadata) {
             outFile.write(outGrids, *fileMetadata);
         } else {
@@ -339,7 +1689,9 @@ main(int argc, char *argv[])
             OPENVDB_LOG_WARN("wrote empty file " << outFilename << " in "
                 << std::setprecision(3) << (msec / 1000.0) << " sec");
         } else {
-            OPENVDB_LOG_INFO("wrote file " << outFilename << " in "
+            OPENVDB_LOG_INFO("wrote file " << outFilename << " ("
+                << openvdb::io::compressionToString(opts.defaultStorage.compression) << ", "
+                << fileSize(outFilename) << " bytes) in "
                 << std::setprecision(3) << (msec / 1000.0) << " sec");
         }
     }
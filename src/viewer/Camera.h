@@ -30,6 +30,10 @@ public:
 
     void setNearFarPlanes(double n, double f) { mNearPlane = n; mFarPlane = f; }
     void setFieldOfView(double degrees) { mFov = degrees; }
+    double fieldOfView() const { return mFov; }
+
+    /// Return the distance from the eye to the point at which the camera is looking.
+    double distance() const { return mDistance; }
     void setSpeed(double zoomSpeed = 0.1, double strafeSpeed = 0.002, double tumblingSpeed = 0.02);
 
     void keyCallback(int key, int action);
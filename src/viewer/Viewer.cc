@@ -13,9 +13,11 @@
 #include <openvdb/points/PointCount.h>
 #include <openvdb/version.h> // for OPENVDB_LIBRARY_MAJOR_VERSION, etc.
 #include <atomic>
-#include <cmath> // for fabs()
+#include <cmath> // for fabs(), std::pow(), std::tan()
+#include <cstdlib> // for std::strtod()
 #include <iomanip> // for std::setprecision()
 #include <iostream>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <sstream>
@@ -66,6 +68,9 @@ public:
     void interrupt();
     void setWindowTitle(double fps = 0.0);
     void showNthGrid(size_t n);
+    size_t selectLevel(size_t n) const;
+    void updateLevel();
+    void buildRenderModules();
     void updateCutPlanes(int wheelPos);
     void swapBuffers();
 
@@ -87,7 +92,9 @@ private:
     RenderModulePtr mViewportModule;
     std::vector<RenderModulePtr> mRenderModules;
     openvdb::GridCPtrVec mGrids;
-    size_t mGridIdx, mUpdates;
+    /// Grids to be displayed, each a list of the mip levels of one grid, finest first
+    std::vector<openvdb::GridCPtrVec> mAssets;
+    size_t mGridIdx, mLevelIdx, mUpdates;
     std::string mGridName, mProgName, mGridInfo, mTransformInfo, mTreeInfo;
     int mWheelPos;
     bool mShiftIsDown, mCtrlIsDown, mShowInfo;
@@ -167,6 +174,38 @@ windowRefreshCB(GLFWwindow*)
     if (sViewer) sViewer->windowRefreshCallback();
 }
 
+
+/// @brief If the given grid is a mip level generated by openvdb_lod,
+/// set @a baseName to the name of the grid from which it was generated
+/// and @a level to its mip level, and return true.
+bool
+getMipLevel(const openvdb::GridBase& grid, std::string& baseName, double& level)
+{
+    // Mip levels are named "NAME_level_N".
+    static const std::string sSuffix = "_level_";
+    const std::string name = grid.getName();
+    const size_t pos = name.rfind(sSuffix);
+    if (pos != std::string::npos && pos > 0) {
+        const char* str = name.c_str() + pos + sSuffix.size();
+        char* end = nullptr;
+        const double value = std::strtod(str, &end);
+        if (end != str && *end == '\0' && value >= 0.0) {
+            baseName = name.substr(0, pos);
+            level = value;
+            return true;
+        }
+    }
+    // A level that kept the name of its grid (openvdb_lod -preserve) is tagged with metadata.
+    if (openvdb::FloatMetadata::ConstPtr meta =
+        grid.getMetadata<openvdb::FloatMetadata>("lod_level"))
+    {
+        baseName = name;
+        level = meta->value();
+        return true;
+    }
+    return false;
+}
+
 } // unnamed namespace
 
 
@@ -358,6 +397,7 @@ ViewerImpl::ViewerImpl()
     , mCamera(new Camera)
     , mClipBox(new ClipBox)
     , mGridIdx(0)
+    , mLevelIdx(0)
     , mUpdates(0)
     , mWheelPos(0)
     , mShiftIsDown(false)
@@ -517,18 +557,47 @@ ViewerImpl::view(const openvdb::GridCPtrVec& gridList)
     mGridIdx = size_t(-1);
     mGridName.clear();
 
-    // Compute the combined bounding box of all the grids.
+    // Group the mip levels of each grid into a single asset, ordered by level,
+    // and give every other grid an asset of its own.
+    {
+        std::vector<std::map<double, openvdb::GridBase::ConstPtr>> assets;
+        std::map<std::pair<std::string, std::string>, size_t> assetIndices;
+        for (const openvdb::GridBase::ConstPtr& grid: gridList) {
+            if (!grid) continue;
+            std::string baseName;
+            double level = 0.0;
+            if (getMipLevel(*grid, baseName, level)) {
+                const auto key = std::make_pair(baseName, grid->type());
+                auto iter = assetIndices.find(key);
+                if (iter == assetIndices.end()) {
+                    iter = assetIndices.emplace(key, assets.size()).first;
+                    assets.emplace_back();
+                }
+                if (assets[iter->second].emplace(level, grid).second) continue;
+            }
+            assets.emplace_back();
+            assets.back().emplace(0.0, grid);
+        }
+        mAssets.clear();
+        for (const auto& levels: assets) {
+            mAssets.emplace_back();
+            for (const auto& level: levels) mAssets.back().push_back(level.second);
+        }
+    }
+
+    // Compute the combined bounding box of all the grids.  The levels of an asset
+    // cover the same region, so only the coarsest, whose topology is smallest, is used.
     openvdb::BBoxd bbox(openvdb::Vec3d(0.0), openvdb::Vec3d(0.0));
-    if (!gridList.empty()) {
-        bbox = worldSpaceBBox(
-            gridList[0]->transform(), gridList[0]->evalActiveVoxelBoundingBox());
-        openvdb::Vec3d voxelSize = gridList[0]->voxelSize();
+    if (!mAssets.empty()) {
+        bbox = worldSpaceBBox(mAssets[0].back()->transform(),
+            mAssets[0].back()->evalActiveVoxelBoundingBox());
+        openvdb::Vec3d voxelSize = mAssets[0].front()->voxelSize();
 
-        for (size_t n = 1; n < gridList.size(); ++n) {
-            bbox.expand(worldSpaceBBox(gridList[n]->transform(),
-                gridList[n]->evalActiveVoxelBoundingBox()));
+        for (size_t n = 1; n < mAssets.size(); ++n) {
+            bbox.expand(worldSpaceBBox(mAssets[n].back()->transform(),
+                mAssets[n].back()->evalActiveVoxelBoundingBox()));
 
-            voxelSize = minComponent(voxelSize, gridList[n]->voxelSize());
+            voxelSize = minComponent(voxelSize, mAssets[n].front()->voxelSize());
         }
         mClipBox->setStepSize(voxelSize);
     }
@@ -640,6 +709,8 @@ ViewerImpl::render()
     // Prepare window for rendering.
     glfwMakeContextCurrent(mWindow);
 
+    updateLevel();
+
     mCamera->aim();
 
     // draw scene
@@ -818,7 +889,7 @@ ViewerImpl::setWindowTitle(double fps)
     std::ostringstream ss;
     ss  << mProgName << ": "
         << (mGridName.empty() ? std::string("OpenVDB") : mGridName)
-        << " (" << (mGridIdx + 1) << " of " << mGrids.size() << ") @ "
+        << " (" << (mGridIdx + 1) << " of " << mAssets.size() << ") @ "
         << std::setprecision(1) << std::fixed << fps << " fps";
     if (mWindow) glfwSetWindowTitle(mWindow, ss.str().c_str());
 }
@@ -830,7 +901,7 @@ ViewerImpl::setWindowTitle(double fps)
 void
 ViewerImpl::showPrevGrid()
 {
-    if (const size_t numGrids = mGrids.size()) {
+    if (const size_t numGrids = mAssets.size()) {
         size_t idx = ((numGrids + mGridIdx) - 1) % numGrids;
         showNthGrid(idx);
     }
@@ -840,7 +911,7 @@ ViewerImpl::showPrevGrid()
 void
 ViewerImpl::showNextGrid()
 {
-    if (const size_t numGrids = mGrids.size()) {
+    if (const size_t numGrids = mAssets.size()) {
         size_t idx = (mGridIdx + 1) % numGrids;
         showNthGrid(idx);
     }
@@ -850,12 +921,77 @@ ViewerImpl::showNextGrid()
 void
 ViewerImpl::showNthGrid(size_t n)
 {
-    if (mGrids.empty()) return;
-    n = n % mGrids.size();
+    if (mAssets.empty()) return;
+    n = n % mAssets.size();
     if (n == mGridIdx) return;
 
-    mGridName = mGrids[n]->getName();
     mGridIdx = n;
+    mLevelIdx = selectLevel(n);
+    buildRenderModules();
+}
+
+
+/// @brief Return the index of the mip level of the @a n-th asset
+/// whose voxels project to about one pixel at the current camera distance.
+size_t
+ViewerImpl::selectLevel(size_t n) const
+{
+    const openvdb::GridCPtrVec& levels = mAssets[n];
+    if (levels.size() < 2 || mWindow == nullptr) return 0;
+
+    int width, height;
+    glfwGetFramebufferSize(mWindow, &width, &height);
+
+    // World-space height of a pixel at the camera distance
+    const double pixelSize = 2.0 * mCamera->distance()
+        * std::tan(0.5 * mCamera->fieldOfView() * openvdb::math::pi<double>() / 180.0)
+        / double(std::max(1, height));
+
+    // Choose the coarsest level whose voxel size is nearer (by ratio) to a pixel
+    // than to two pixels, so that no level is ever drawn with voxels much larger
+    // than a pixel, except when even the finest level's are.
+    // The levels of a point data grid share a voxel size, but each keeps
+    // an eighth of the points of the previous one, doubling their spacing.
+    size_t level = 0;
+    for (size_t i = 1; i < levels.size(); ++i) {
+        double size = levels[i]->voxelSize()[0];
+        std::string baseName;
+        double mipLevel = 0.0;
+        if (levels[i]->isType<openvdb::points::PointDataGrid>()
+            && getMipLevel(*levels[i], baseName, mipLevel))
+        {
+            size *= std::pow(2.0, mipLevel);
+        }
+        if (size <= std::sqrt(2.0) * pixelSize) level = i;
+    }
+    return level;
+}
+
+
+/// @brief Switch to the mip level of the current asset that best suits
+/// the current camera distance, if it is not already displayed.
+void
+ViewerImpl::updateLevel()
+{
+    if (mGridIdx >= mAssets.size()) return;
+    const size_t level = selectLevel(mGridIdx);
+    if (level == mLevelIdx) return;
+
+    OPENVDB_LOG_DEBUG_RUNTIME("switching from \"" << mAssets[mGridIdx][mLevelIdx]->getName()
+        << "\" to \"" << mAssets[mGridIdx][level]->getName() << "\"");
+    mLevelIdx = level;
+    buildRenderModules();
+}
+
+
+/// Construct the render modules for the current mip level of the current asset.
+void
+ViewerImpl::buildRenderModules()
+{
+    const openvdb::GridCPtrVec& levels = mAssets[mGridIdx];
+    const openvdb::GridBase::ConstPtr& grid = levels[mLevelIdx];
+
+    mGridName = grid->getName();
 
     // save render settings
     std::vector<bool> active(mRenderModules.size());
@@ -864,9 +1000,9 @@ ViewerImpl::showNthGrid(size_t n)
     }
 
     mRenderModules.clear();
-    mRenderModules.push_back(RenderModulePtr(new TreeTopologyModule(mGrids[n])));
-    mRenderModules.push_back(RenderModulePtr(new MeshModule(mGrids[n])));
-    mRenderModules.push_back(RenderModulePtr(new VoxelModule(mGrids[n])));
+    mRenderModules.push_back(RenderModulePtr(new TreeTopologyModule(grid)));
+    mRenderModules.push_back(RenderModulePtr(new MeshModule(grid)));
+    mRenderModules.push_back(RenderModulePtr(new VoxelModule(grid)));
 
     if (active.empty()) {
         for (size_t i = 1, I = mRenderModules.size(); i < I; ++i) {
@@ -881,33 +1017,36 @@ ViewerImpl::showNthGrid(size_t n)
     // Collect info
     {
         std::ostringstream ostrm;
-        std::string s = mGrids[n]->getName();
-        const openvdb::GridClass cls = mGrids[n]->getGridClass();
+        std::string s = grid->getName();
+        const openvdb::GridClass cls = grid->getGridClass();
         if (!s.empty()) ostrm << s << " / ";
-        ostrm << mGrids[n]->valueType() << " / ";
+        ostrm << grid->valueType() << " / ";
         if (cls == openvdb::GRID_UNKNOWN) ostrm << " class unknown";
         else ostrm << " " << openvdb::GridBase::gridClassToString(cls);
         mGridInfo = ostrm.str();
     }
     {
-        openvdb::Coord dim = mGrids[n]->evalActiveVoxelDim();
+        openvdb::Coord dim = grid->evalActiveVoxelDim();
         std::ostringstream ostrm;
         ostrm << dim[0] << " x " << dim[1] << " x " << dim[2]
-            << " / voxel size " << std::setprecision(4) << mGrids[n]->voxelSize()[0]
-            << " (" << mGrids[n]->transform().mapType() << ")";
+            << " / voxel size " << std::setprecision(4) << grid->voxelSize()[0]
+            << " (" << grid->transform().mapType() << ")";
+        if (levels.size() > 1) {
+            ostrm << " / level " << (mLevelIdx + 1) << " of " << levels.size();
+        }
         mTransformInfo = ostrm.str();
     }
     {
         std::ostringstream ostrm;
-        const openvdb::Index64 count = mGrids[n]->activeVoxelCount();
+        const openvdb::Index64 count = grid->activeVoxelCount();
         ostrm << openvdb::util::formattedInt(count)
             << " active voxel" << (count == 1 ? "" : "s");
         mTreeInfo = ostrm.str();
     }
     {
-        if (mGrids[n]->isType<openvdb::points::PointDataGrid>()) {
+        if (grid->isType<openvdb::points::PointDataGrid>()) {
             const openvdb::points::PointDataGrid::ConstPtr points =
-                openvdb::gridConstPtrCast<openvdb::points::PointDataGrid>(mGrids[n]);
+                openvdb::gridConstPtrCast<openvdb::points::PointDataGrid>(grid);
             const openvdb::Index64 count = openvdb::points::pointCount(points->tree());
             std::ostringstream ostrm;
             ostrm << " / " << openvdb::util::formattedInt(count)